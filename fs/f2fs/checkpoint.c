@@ -16,6 +16,7 @@
 #include <linux/f2fs_fs.h>
 #include <linux/pagevec.h>
 #include <linux/swap.h>
+#include <linux/ktime.h>
 
 #include "f2fs.h"
 #include "node.h"
@@ -117,14 +118,23 @@ long sync_meta_pages(struct f2fs_sb_info *sbi, enum page_type type,
 	struct address_space *mapping = sbi->meta_inode->i_mapping;
 	pgoff_t index = 0, end = LONG_MAX;
 	struct pagevec pvec;
+	struct blk_plug plug;
+	pgoff_t last_index = 0;
 	long nwritten = 0;
 	struct writeback_control wbc = {
 	 .for_reclaim = 0,
 	};
 
 	pagevec_init(&pvec, 0);
+	blk_start_plug(&plug);
 
-	while (index <= end) {
+	/*
+	 * Dirty pages come out of the tag lookup in index order, and the index
+	 * of a meta page is its block address. So the current meta bio keeps
+	 * growing while the addresses are contiguous, and it is submitted as
+	 * soon as a gap shows up instead of waiting for the next page.
+	 */
+	while (index <= end && nwritten < nr_to_write) {
 	 int i, nr_pages;
 	 nr_pages = pagevec_lookup_tag(&pvec, mapping, &index,
 	 PAGECACHE_TAG_DIRTY,
@@ -132,22 +142,31 @@ long sync_meta_pages(struct f2fs_sb_info *sbi, enum page_type type,
 	 if (nr_pages == 0)
 	 break;
 
-	 for (i = 0; i < nr_pages; i++) {
+	 for (i = 0; i < nr_pages && nwritten < nr_to_write; i++) {
 	 struct page *page = pvec.pages[i];
+
+	 if (!nwritten || page->index != last_index + 1) {
+	 if (nwritten)
+	 f2fs_submit_bio(sbi, META, false);
+	 sbi->meta_runs++;
+	 }
+	 last_index = page->index;
+
 	 lock_page(page);
 	 BUG_ON(page->mapping != mapping);
 	 BUG_ON(!PageDirty(page));
 	 clear_page_dirty_for_io(page);
 	 f2fs_write_meta_page(page, &wbc);
-	 if (nwritten++ >= nr_to_write)
-	 break;
+	 nwritten++;
 	 }
 	 pagevec_release(&pvec);
 	 cond_resched();
 	}
 
+	sbi->meta_written += nwritten;
 	if (nwritten)
 	 f2fs_submit_bio(sbi, type, nr_to_write == LONG_MAX);
+	blk_finish_plug(&plug);
 
 	return nwritten;
 }
@@ -551,6 +570,10 @@ void block_operations(struct f2fs_sb_info *sbi)
 	 .for_reclaim = 0,
 	};
 
+	/* Wait for the direct writes whose blocks are not written yet */
+	down_write(&sbi->dio_sem);
+	sbi->cp_task = current;
+
 	/* Stop renaming operation */
 	mutex_lock_op(sbi, RENAME);
 	mutex_lock_op(sbi, DENTRY_OPS);
@@ -592,6 +615,8 @@ static void unblock_operations(struct f2fs_sb_info *sbi)
 	int t;
 	for (t = NODE_WRITE; t >= RENAME; t--)
 	 mutex_unlock_op(sbi, t);
+	sbi->cp_task = NULL;
+	up_write(&sbi->dio_sem);
 }
 
 static void do_checkpoint(struct f2fs_sb_info *sbi, bool is_umount)
@@ -601,7 +626,7 @@ static void do_checkpoint(struct f2fs_sb_info *sbi, bool is_umount)
 	int nat_upd_blkoff[3];
 	block_t start_blk;
 	struct page *cp_page;
-	unsigned int data_sum_blocks, orphan_blocks;
+	unsigned int data_sum_blocks, orphan_blocks, segmap_blocks = 0;
 	void *kaddr;
 	__u32 crc32 = 0;
 	int i;
@@ -651,8 +676,25 @@ static void do_checkpoint(struct f2fs_sb_info *sbi, bool is_umount)
 
 	orphan_blocks = (sbi->n_orphans + F2FS_ORPHANS_PER_BLOCK - 1)
 	 / F2FS_ORPHANS_PER_BLOCK;
-	ckpt->cp_pack_start_sum = 1 + orphan_blocks;
-	ckpt->cp_pack_total_block_count = 2 + data_sum_blocks + orphan_blocks;
+
+	/*
+	 * segment maps are located where orphan blocks are expected, so they
+	 * are written only if there is no orphan and the CP pack fits a segment
+	 */
+	if (is_umount && !sbi->n_orphans) {
+	 segmap_blocks = npages_for_segmap_summary(sbi);
+	 if (2 + data_sum_blocks + NR_CURSEG_NODE_TYPE + segmap_blocks >
+	 sbi->blocks_per_seg)
+	 segmap_blocks = 0;
+	}
+	if (segmap_blocks)
+	 ckpt->ckpt_flags |= CP_SEGMAP_FLAG;
+	else
+	 ckpt->ckpt_flags &= (~CP_SEGMAP_FLAG);
+
+	ckpt->cp_pack_start_sum = 1 + orphan_blocks + segmap_blocks;
+	ckpt->cp_pack_total_block_count = 2 + data_sum_blocks + orphan_blocks +
+	 segmap_blocks;
 
 	if (is_umount) {
 	 ckpt->ckpt_flags |= CP_UMOUNT_FLAG;
@@ -689,6 +731,11 @@ static void do_checkpoint(struct f2fs_sb_info *sbi, bool is_umount)
 	 start_blk += orphan_blocks;
 	}
 
+	if (segmap_blocks) {
+	 write_segmap_summary(sbi, start_blk);
+	 start_blk += segmap_blocks;
+	}
+
 	write_data_summaries(sbi, start_blk);
 	start_blk += data_sum_blocks;
 	if (is_umount) {
@@ -731,6 +778,8 @@ void write_checkpoint(struct f2fs_sb_info *sbi, bool blocked, bool is_umount)
 {
 	struct f2fs_checkpoint *ckpt = F2FS_CKPT(sbi);
 	unsigned long long ckpt_ver;
+	ktime_t start = ktime_get();
+	unsigned int elapsed;
 
 	if (!blocked) {
 	 mutex_lock(&sbi->cp_mutex);
@@ -758,6 +807,12 @@ void write_checkpoint(struct f2fs_sb_info *sbi, bool blocked, bool is_umount)
 	/* unlock all the fs_lock[] in do_checkpoint() */
 	do_checkpoint(sbi, is_umount);
 
+	elapsed = ktime_us_delta(ktime_get(), start);
+	sbi->cp_count++;
+	sbi->cp_total_us += elapsed;
+	if (elapsed > sbi->cp_max_us)
+	 sbi->cp_max_us = elapsed;
+
 	unblock_operations(sbi);
 	mutex_unlock(&sbi->cp_mutex);
 }
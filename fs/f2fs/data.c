@@ -12,6 +12,8 @@
 #include <linux/f2fs_fs.h>
 #include <linux/buffer_head.h>
 #include <linux/mpage.h>
+#include <linux/pagevec.h>
+#include <linux/aio.h>
 #include <linux/writeback.h>
 #include <linux/backing-dev.h>
 #include <linux/blkdev.h>
@@ -59,51 +61,366 @@ int reserve_new_block(struct dnode_of_data *dn)
 	return 0;
 }
 
-static int check_extent_cache(struct inode *inode, pgoff_t pgofs,
-	 struct buffer_head *bh_result)
+static struct kmem_cache *extent_node_slab;
+
+static struct extent_node *__lookup_extent_node(struct extent_tree *et,
+	 pgoff_t fofs)
+{
+	struct rb_node *node = et->root.rb_node;
+	struct extent_node *en = et->cached_en;
+
+	if (en && fofs >= en->ei.fofs && fofs < en->ei.fofs + en->ei.len)
+	 return en;
+
+	while (node) {
+	 en = rb_entry(node, struct extent_node, rb_node);
+	 if (fofs < en->ei.fofs) {
+	 node = node->rb_left;
+	 } else if (fofs >= en->ei.fofs + en->ei.len) {
+	 node = node->rb_right;
+	 } else {
+	 et->cached_en = en;
+	 return en;
+	 }
+	}
+	return NULL;
+}
+
+/**
+ * Return the first extent starting after fofs
+ */
+static struct extent_node *__lookup_next_extent(struct extent_tree *et,
+	 pgoff_t fofs)
+{
+	struct rb_node *node = et->root.rb_node;
+	struct extent_node *en, *next = NULL;
+
+	while (node) {
+	 en = rb_entry(node, struct extent_node, rb_node);
+	 if (fofs < en->ei.fofs) {
+	 next = en;
+	 node = node->rb_left;
+	 } else {
+	 node = node->rb_right;
+	 }
+	}
+	return next;
+}
+
+/**
+ * Evict nr extent nodes from the head of the LRU list.
+ * The extent tree held by the caller and the ones being used by others are
+ * skipped, since the locks of extent trees come before extent_lock.
+ */
+static int __shrink_extent_nodes(struct f2fs_sb_info *sbi, int nr,
+	 struct extent_tree *self)
+{
+	int scan = atomic_read(&sbi->total_ext_node);
+	struct extent_node *en;
+	struct extent_tree *et;
+	int freed = 0;
+
+	spin_lock(&sbi->extent_lock);
+	while (freed < nr && scan-- > 0 && !list_empty(&sbi->extent_list)) {
+	 en = list_first_entry(&sbi->extent_list, struct extent_node, list);
+	 et = en->et;
+	 if (et == self || !write_trylock(&et->lock)) {
+	 list_move_tail(&en->list, &sbi->extent_list);
+	 continue;
+	 }
+	 list_del(&en->list);
+	 rb_erase(&en->rb_node, &et->root);
+	 if (et->cached_en == en)
+	 et->cached_en = NULL;
+	 et->count--;
+	 write_unlock(&et->lock);
+
+	 kmem_cache_free(extent_node_slab, en);
+	 atomic_dec(&sbi->total_ext_node);
+	 freed++;
+	}
+	spin_unlock(&sbi->extent_lock);
+
+	atomic_add(freed, &sbi->evicted_ext);
+	return freed;
+}
+
+/**
+ * Caller should make sure that the new extent does not overlap the others.
+ * The least recently used extents are evicted to keep the budget.
+ */
+static struct extent_node *__insert_extent_node(struct f2fs_sb_info *sbi,
+	 struct extent_tree *et, struct extent_info *ei)
+{
+	struct rb_node **p = &et->root.rb_node;
+	struct rb_node *parent = NULL;
+	struct extent_node *en;
+	int over;
+
+	over = atomic_read(&sbi->total_ext_node) -
+	 (int)sbi->mount_opt.max_extents + 1;
+	if (over > 0 && __shrink_extent_nodes(sbi, over, et) < over)
+	 return NULL;
+
+	while (*p) {
+	 parent = *p;
+	 en = rb_entry(parent, struct extent_node, rb_node);
+	 if (ei->fofs < en->ei.fofs)
+	 p = &(*p)->rb_left;
+	 else
+	 p = &(*p)->rb_right;
+	}
+
+	en = kmem_cache_alloc(extent_node_slab, GFP_ATOMIC);
+	if (!en)
+	 return NULL;
+	en->ei = *ei;
+	en->et = et;
+	en->access = jiffies;
+	rb_link_node(&en->rb_node, parent, p);
+	rb_insert_color(&en->rb_node, &et->root);
+	et->count++;
+
+	spin_lock(&sbi->extent_lock);
+	list_add_tail(&en->list, &sbi->extent_list);
+	spin_unlock(&sbi->extent_lock);
+	atomic_inc(&sbi->total_ext_node);
+	return en;
+}
+
+static void __release_extent_node(struct f2fs_sb_info *sbi,
+	 struct extent_tree *et, struct extent_node *en)
+{
+	rb_erase(&en->rb_node, &et->root);
+	if (et->cached_en == en)
+	 et->cached_en = NULL;
+	et->count--;
+
+	spin_lock(&sbi->extent_lock);
+	list_del(&en->list);
+	spin_unlock(&sbi->extent_lock);
+	atomic_dec(&sbi->total_ext_node);
+	kmem_cache_free(extent_node_slab, en);
+}
+
+static bool __update_largest_extent(struct extent_tree *et,
+	 struct extent_node *en)
+{
+	if (!en || en->ei.len <= et->largest.len)
+	 return false;
+	et->largest = en->ei;
+	return true;
+}
+
+/**
+ * Append or prepend a block adjacent to the largest extent. Its extent node
+ * may have been evicted or never inserted, so it cannot grow through one.
+ */
+static bool __grow_largest_extent(struct extent_info *largest, pgoff_t fofs,
+	 block_t blk_addr)
+{
+	if (!largest->len) {
+	 largest->fofs = fofs;
+	 largest->blk_addr = blk_addr;
+	 largest->len = 1;
+	} else if (fofs == largest->fofs + largest->len &&
+	 blk_addr == largest->blk_addr + largest->len) {
+	 largest->len++;
+	} else if (fofs + 1 == largest->fofs &&
+	 blk_addr + 1 == largest->blk_addr) {
+	 largest->fofs--;
+	 largest->blk_addr--;
+	 largest->len++;
+	} else {
+	 return false;
+	}
+	return true;
+}
+
+/**
+ * Replace the block address of fofs in the extent tree.
+ * It returns true if the largest extent, which is kept on disk, is changed.
+ */
+static bool __update_extent_tree(struct f2fs_sb_info *sbi,
+	 struct extent_tree *et, pgoff_t fofs, block_t blk_addr)
+{
+	struct extent_info *largest = &et->largest;
+	struct extent_node *en, *prev, *next;
+	struct extent_info ei;
+	bool changed = false;
+
+	et->version++;
+
+	/* 1) Take fofs out of the extent having it */
+	en = __lookup_extent_node(et, fofs);
+	if (en) {
+	 ei = en->ei;
+	 if (fofs == ei.fofs) {
+	 en->ei.fofs++;
+	 en->ei.blk_addr++;
+	 en->ei.len--;
+	 } else if (fofs == ei.fofs + ei.len - 1) {
+	 en->ei.len--;
+	 } else {
+	 /* Split it, and keep the larger part if no room */
+	 en->ei.len = fofs - ei.fofs;
+	 ei.blk_addr += fofs - ei.fofs + 1;
+	 ei.len -= fofs - ei.fofs + 1;
+	 ei.fofs = fofs + 1;
+	 if (!__insert_extent_node(sbi, et, &ei) &&
+	 ei.len > en->ei.len)
+	 en->ei = ei;
+	 }
+	 if (!en->ei.len)
+	 __release_extent_node(sbi, et, en);
+	}
+
+	if (largest->len && fofs >= largest->fofs &&
+	 fofs < largest->fofs + largest->len) {
+	 unsigned int left = fofs - largest->fofs;
+	 unsigned int right = largest->len - left - 1;
+
+	 if (left >= right) {
+	 largest->len = left;
+	 } else {
+	 largest->fofs = fofs + 1;
+	 largest->blk_addr += left + 1;
+	 largest->len = right;
+	 }
+	 changed = true;
+	}
+
+	if (blk_addr == NULL_ADDR)
+	 return changed;
+
+	/* 2) Merge the new block into its neighbors, or add a new extent */
+	prev = fofs ? __lookup_extent_node(et, fofs - 1) : NULL;
+	next = __lookup_extent_node(et, fofs + 1);
+	en = NULL;
+
+	if (prev && prev->ei.blk_addr + prev->ei.len == blk_addr) {
+	 prev->ei.len++;
+	 en = prev;
+	}
+	if (next && next->ei.blk_addr == blk_addr + 1) {
+	 if (en) {
+	 en->ei.len += next->ei.len;
+	 __release_extent_node(sbi, et, next);
+	 } else {
+	 next->ei.fofs--;
+	 next->ei.blk_addr--;
+	 next->ei.len++;
+	 en = next;
+	 }
+	}
+	if (!en) {
+	 ei.fofs = fofs;
+	 ei.blk_addr = blk_addr;
+	 ei.len = 1;
+	 en = __insert_extent_node(sbi, et, &ei);
+	}
+	if (__grow_largest_extent(largest, fofs, blk_addr))
+	 changed = true;
+	return __update_largest_extent(et, en) || changed;
+}
+
+/**
+ * Look up the extent having pgofs in the extent tree or in the largest one.
+ * A node moved to the LRU tail lately stays where it is, so that readers
+ * hitting the same extents do not serialize on extent_lock.
+ */
+static bool lookup_extent_cache(struct inode *inode, pgoff_t pgofs,
+	 struct extent_info *ei)
 {
-	struct f2fs_inode_info *fi = F2FS_I(inode);
 	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
-	pgoff_t start_fofs, end_fofs;
-	block_t start_blkaddr;
+	struct extent_tree *et = &F2FS_I(inode)->ext;
+	struct extent_info *largest = &et->largest;
+	struct extent_node *en;
+	bool hit = true;
+
+	read_lock(&et->lock);
+	if (!et->count && !largest->len) {
+	 read_unlock(&et->lock);
+	 return false;
+	}
 
-	read_lock(&fi->ext.ext_lock);
-	if (fi->ext.len == 0) {
-	 read_unlock(&fi->ext.ext_lock);
-	 return 0;
+	atomic_inc(&sbi->total_hit_ext);
+	en = __lookup_extent_node(et, pgofs);
+	if (en) {
+	 *ei = en->ei;
+	 if (time_after(jiffies, en->access + EXTENT_LRU_INTERVAL)) {
+	 en->access = jiffies;
+	 spin_lock(&sbi->extent_lock);
+	 list_move_tail(&en->list, &sbi->extent_list);
+	 spin_unlock(&sbi->extent_lock);
+	 }
+	} else if (pgofs >= largest->fofs &&
+	 pgofs < largest->fofs + largest->len) {
+	 *ei = *largest;
+	} else {
+	 hit = false;
 	}
 
-	sbi->total_hit_ext++;
-	start_fofs = fi->ext.fofs;
-	end_fofs = fi->ext.fofs + fi->ext.len - 1;
-	start_blkaddr = fi->ext.blk_addr;
+	if (hit)
+	 atomic_inc(&sbi->read_hit_ext);
+	read_unlock(&et->lock);
+	return hit;
+}
+
+static int check_extent_cache(struct inode *inode, pgoff_t pgofs,
+	 struct buffer_head *bh_result)
+{
+	unsigned int blkbits = inode->i_sb->s_blocksize_bits;
+	struct extent_info ei;
+	size_t count;
 
-	if (pgofs >= start_fofs && pgofs <= end_fofs) {
-	 unsigned int blkbits = inode->i_sb->s_blocksize_bits;
-	 size_t count;
+	if (!lookup_extent_cache(inode, pgofs, &ei))
+	 return 0;
 
-	 clear_buffer_new(bh_result);
-	 map_bh(bh_result, inode->i_sb,
-	 start_blkaddr + pgofs - start_fofs);
-	 count = end_fofs - pgofs + 1;
-	 if (count < (UINT_MAX >> blkbits))
+	clear_buffer_new(bh_result);
+	map_bh(bh_result, inode->i_sb, ei.blk_addr + pgofs - ei.fofs);
+	count = ei.fofs + ei.len - pgofs;
+	if (count < (UINT_MAX >> blkbits))
 	 bh_result->b_size = (count << blkbits);
-	 else
+	else
 	 bh_result->b_size = UINT_MAX;
+	return 1;
+}
 
-	 sbi->read_hit_ext++;
-	 read_unlock(&fi->ext.ext_lock);
-	 return 1;
-	}
-	read_unlock(&fi->ext.ext_lock);
-	return 0;
+/**
+ * Cache the extent found by a read, unless the extent tree has been
+ * updated since the block addresses were looked up at version.
+ */
+static void insert_extent_cache(struct inode *inode, pgoff_t fofs,
+	 block_t blk_addr, unsigned int len, unsigned long long version)
+{
+	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
+	struct extent_tree *et = &F2FS_I(inode)->ext;
+	struct extent_node *next;
+	struct extent_info ei;
+
+	write_lock(&et->lock);
+	if (et->version != version || __lookup_extent_node(et, fofs))
+	 goto out;
+
+	next = __lookup_next_extent(et, fofs);
+	if (next && next->ei.fofs < fofs + len)
+	 len = next->ei.fofs - fofs;
+
+	ei.fofs = fofs;
+	ei.blk_addr = blk_addr;
+	ei.len = len;
+	__update_largest_extent(et, __insert_extent_node(sbi, et, &ei));
+out:
+	write_unlock(&et->lock);
 }
 
 void update_extent_cache(block_t blk_addr, struct dnode_of_data *dn)
 {
-	struct f2fs_inode_info *fi = F2FS_I(dn->inode);
-	pgoff_t fofs, start_fofs, end_fofs;
-	block_t start_blkaddr, end_blkaddr;
+	struct f2fs_sb_info *sbi = F2FS_SB(dn->inode->i_sb);
+	struct extent_tree *et = &F2FS_I(dn->inode)->ext;
+	pgoff_t fofs;
+	bool changed, stale;
 
 	BUG_ON(blk_addr == NEW_ADDR);
 	fofs = start_bidx_of_node(ofs_of_node(dn->node_page)) + dn->ofs_in_node;
@@ -111,69 +428,88 @@ void update_extent_cache(block_t blk_addr, struct dnode_of_data *dn)
 	/* Update the page address in the parent node */
 	__set_data_blkaddr(dn, blk_addr);
 
-	write_lock(&fi->ext.ext_lock);
+	write_lock(&et->lock);
+	stale = fofs >= et->disk.fofs && fofs < et->disk.fofs + et->disk.len;
+	changed = __update_extent_tree(sbi, et, fofs, blk_addr);
+	write_unlock(&et->lock);
 
-	start_fofs = fi->ext.fofs;
-	end_fofs = fi->ext.fofs + fi->ext.len - 1;
-	start_blkaddr = fi->ext.blk_addr;
-	end_blkaddr = fi->ext.blk_addr + fi->ext.len - 1;
-
-	/* Drop and initialize the matched extent */
-	if (fi->ext.len == 1 && fofs == start_fofs)
-	 fi->ext.len = 0;
-
-	/* Initial extent */
-	if (fi->ext.len == 0) {
-	 if (blk_addr != NULL_ADDR) {
-	 fi->ext.fofs = fofs;
-	 fi->ext.blk_addr = blk_addr;
-	 fi->ext.len = 1;
-	 }
-	 goto end_update;
+	/*
+	 * The extent in the inode page should not map a block moved, but
+	 * a grown one can wait for the inode to be written back.
+	 */
+	if (stale) {
+	 sync_inode_page(dn);
+	} else if (changed) {
+	 atomic_inc(&sbi->lazy_ext);
+	 mark_inode_dirty_sync(dn->inode);
 	}
+}
 
-	/* Frone merge */
-	if (fofs == start_fofs - 1 && blk_addr == start_blkaddr - 1) {
-	 fi->ext.fofs--;
-	 fi->ext.blk_addr--;
-	 fi->ext.len++;
-	 goto end_update;
-	}
+/**
+ * Build the extent tree of an inode from i_ext on disk
+ */
+void get_extent_info(struct inode *inode, struct f2fs_extent i_ext)
+{
+	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
+	struct extent_tree *et = &F2FS_I(inode)->ext;
+	struct extent_info ei;
+
+	ei.fofs = le32_to_cpu(i_ext.fofs);
+	ei.blk_addr = le32_to_cpu(i_ext.blk_addr);
+	ei.len = le32_to_cpu(i_ext.len);
+
+	write_lock(&et->lock);
+	et->largest = ei;
+	et->disk = ei;
+	if (ei.len)
+	 __insert_extent_node(sbi, et, &ei);
+	write_unlock(&et->lock);
+}
 
-	/* Back merge */
-	if (fofs == end_fofs + 1 && blk_addr == end_blkaddr + 1) {
-	 fi->ext.len++;
-	 goto end_update;
-	}
+void destroy_extent_tree(struct inode *inode)
+{
+	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
+	struct extent_tree *et = &F2FS_I(inode)->ext;
+	struct rb_node *node;
+
+	write_lock(&et->lock);
+	while ((node = rb_first(&et->root)))
+	 __release_extent_node(sbi, et,
+	 rb_entry(node, struct extent_node, rb_node));
+	write_unlock(&et->lock);
+}
 
-	/* Split the existing extent */
-	if (fi->ext.len > 1 &&
-	 fofs >= start_fofs && fofs <= end_fofs) {
-	 if ((end_fofs - fofs) < (fi->ext.len >> 1)) {
-	 fi->ext.len = fofs - start_fofs;
-	 } else {
-	 fi->ext.fofs = fofs + 1;
-	 fi->ext.blk_addr = start_blkaddr +
-	 fofs - start_fofs + 1;
-	 fi->ext.len -= fofs - start_fofs + 1;
-	 }
-	 goto end_update;
+/**
+ * Get the block address of a data page from the extent cache, or from its
+ * direct node on a miss.
+ */
+static int get_data_blkaddr(struct inode *inode, pgoff_t index,
+	 block_t *blk_addr)
+{
+	struct dnode_of_data dn;
+	struct extent_info ei;
+	int err;
+
+	if (lookup_extent_cache(inode, index, &ei)) {
+	 *blk_addr = ei.blk_addr + index - ei.fofs;
+	 return 0;
 	}
-	write_unlock(&fi->ext.ext_lock);
-	return;
 
-end_update:
-	write_unlock(&fi->ext.ext_lock);
-	sync_inode_page(dn);
-	return;
+	set_new_dnode(&dn, inode, NULL, NULL, 0);
+	err = get_dnode_of_data(&dn, index, RDONLY_NODE);
+	if (err)
+	 return err;
+	f2fs_put_dnode(&dn);
+	*blk_addr = dn.data_blkaddr;
+	return 0;
 }
 
 struct page *find_data_page(struct inode *inode, pgoff_t index)
 {
 	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
 	struct address_space *mapping = inode->i_mapping;
-	struct dnode_of_data dn;
 	struct page *page;
+	block_t blk_addr;
 	int err;
 
 	page = find_get_page(mapping, index);
@@ -181,23 +517,21 @@ struct page *find_data_page(struct inode *inode, pgoff_t index)
 	 return page;
 	f2fs_put_page(page, 0);
 
-	set_new_dnode(&dn, inode, NULL, NULL, 0);
-	err = get_dnode_of_data(&dn, index, RDONLY_NODE);
+	err = get_data_blkaddr(inode, index, &blk_addr);
 	if (err)
 	 return ERR_PTR(err);
-	f2fs_put_dnode(&dn);
 
-	if (dn.data_blkaddr == NULL_ADDR)
+	if (blk_addr == NULL_ADDR)
 	 return ERR_PTR(-ENOENT);
 
-	BUG_ON(dn.data_blkaddr == NEW_ADDR);
-	BUG_ON(dn.data_blkaddr == NULL_ADDR);
+	BUG_ON(blk_addr == NEW_ADDR);
+	BUG_ON(blk_addr == NULL_ADDR);
 
 	page = grab_cache_page(mapping, index);
 	if (!page)
 	 return ERR_PTR(-ENOMEM);
 
-	err = f2fs_readpage(sbi, page, dn.data_blkaddr, READ_SYNC);
+	err = f2fs_readpage(sbi, page, blk_addr, READ_SYNC);
 	if (err) {
 	 f2fs_put_page(page, 1);
 	 return ERR_PTR(err);
@@ -215,17 +549,15 @@ struct page *get_lock_data_page(struct inode *inode, pgoff_t index)
 {
 	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
 	struct address_space *mapping = inode->i_mapping;
-	struct dnode_of_data dn;
 	struct page *page;
+	block_t blk_addr;
 	int err;
 
-	set_new_dnode(&dn, inode, NULL, NULL, 0);
-	err = get_dnode_of_data(&dn, index, RDONLY_NODE);
+	err = get_data_blkaddr(inode, index, &blk_addr);
 	if (err)
 	 return ERR_PTR(err);
-	f2fs_put_dnode(&dn);
 
-	if (dn.data_blkaddr == NULL_ADDR)
+	if (blk_addr == NULL_ADDR)
 	 return ERR_PTR(-ENOENT);
 
 	page = grab_cache_page(mapping, index);
@@ -235,10 +567,10 @@ struct page *get_lock_data_page(struct inode *inode, pgoff_t index)
 	if (PageUptodate(page))
 	 return page;
 
-	BUG_ON(dn.data_blkaddr == NEW_ADDR);
-	BUG_ON(dn.data_blkaddr == NULL_ADDR);
+	BUG_ON(blk_addr == NEW_ADDR);
+	BUG_ON(blk_addr == NULL_ADDR);
 
-	err = f2fs_readpage(sbi, page, dn.data_blkaddr, READ_SYNC);
+	err = f2fs_readpage(sbi, page, blk_addr, READ_SYNC);
 	if (err) {
 	 f2fs_put_page(page, 1);
 	 return ERR_PTR(err);
@@ -317,10 +649,24 @@ static void read_end_io(struct bio *bio, int err)
 	 }
 	 unlock_page(page);
 	} while (bvec >= bio->bi_io_vec);
-	kfree(bio->bi_private);
 	bio_put(bio);
 }
 
+/**
+ * Read bios are taken from fs_bio_set, since a reader never holds one under
+ * assembly while it waits for another.
+ */
+static struct bio *f2fs_read_bio_alloc(struct f2fs_sb_info *sbi,
+	 sector_t sector, int nr_vecs)
+{
+	struct bio *bio;
+
+	bio = bio_alloc(GFP_NOFS | __GFP_HIGH, nr_vecs);
+	bio->bi_bdev = sbi->sb->s_bdev;
+	bio->bi_sector = sector;
+	return bio;
+}
+
 /**
  * Fill the locked page with data located in the block address.
  * Read operation is synchronous, and caller must unlock the page.
@@ -328,7 +674,6 @@ static void read_end_io(struct bio *bio, int err)
 int f2fs_readpage(struct f2fs_sb_info *sbi, struct page *page,
 	 block_t blk_addr, int type)
 {
-	struct block_device *bdev = sbi->sb->s_bdev;
 	bool sync = (type == READ_SYNC);
 	struct bio *bio;
 
@@ -339,23 +684,17 @@ int f2fs_readpage(struct f2fs_sb_info *sbi, struct page *page,
 	 return 0;
 	}
 
-	down_read(&sbi->bio_sem);
-
 	/* Allocate a new bio */
-	bio = f2fs_bio_alloc(bdev, blk_addr << (sbi->log_blocksize - 9),
-	 1, GFP_NOFS | __GFP_HIGH);
+	bio = f2fs_read_bio_alloc(sbi, blk_addr << (sbi->log_blocksize - 9), 1);
 
 	/* Initialize the bio */
 	bio->bi_end_io = read_end_io;
 	if (bio_add_page(bio, page, PAGE_CACHE_SIZE, 0) < PAGE_CACHE_SIZE) {
-	 kfree(bio->bi_private);
 	 bio_put(bio);
-	 up_read(&sbi->bio_sem);
 	 return -EFAULT;
 	}
 
 	submit_bio(type, bio);
-	up_read(&sbi->bio_sem);
 
 	/* wait for read completion if sync */
 	if (sync) {
@@ -366,6 +705,67 @@ int f2fs_readpage(struct f2fs_sb_info *sbi, struct page *page,
 	return 0;
 }
 
+/**
+ * Add a locked page to the read bio when the page's block follows the bio.
+ * Otherwise, submit the bio and start a new one from the page.
+ * The page is unlocked at the end of read, and the caller should submit the
+ * returned bio after the last page.
+ */
+struct bio *f2fs_read_merged(struct f2fs_sb_info *sbi, struct bio *bio,
+	 struct page *page, block_t blk_addr, int type)
+{
+	struct block_device *bdev = sbi->sb->s_bdev;
+	sector_t sector = (sector_t)blk_addr << (sbi->log_blocksize - 9);
+
+	if (bio && bio->bi_sector + (bio->bi_size >> 9) == sector &&
+	 bio_add_page(bio, page, PAGE_CACHE_SIZE, 0) == PAGE_CACHE_SIZE)
+	 return bio;
+
+	if (bio)
+	 submit_bio(type, bio);
+
+	bio = f2fs_read_bio_alloc(sbi, sector, bio_get_nr_vecs(bdev));
+	bio->bi_end_io = read_end_io;
+	bio_add_page(bio, page, PAGE_CACHE_SIZE, 0);
+	return bio;
+}
+
+/**
+ * Count the blocks which are consecutive on disk from dn->data_blkaddr.
+ * A run reaching the end of its dnode goes on into the next dnode, so that
+ * large reads are not cut at every dnode boundary. The sibling dnodes under
+ * an indirect node are already read ahead by get_node_page_ra().
+ * dn is released on return.
+ */
+static unsigned int count_contig_blocks(struct dnode_of_data *dn,
+	 pgoff_t pgofs, unsigned int maxblocks)
+{
+	block_t blkaddr = dn->data_blkaddr;
+	unsigned int ofs_in_node = dn->ofs_in_node;
+	unsigned int end_offset, len = 0;
+
+	while (1) {
+	 end_offset = IS_INODE(dn->node_page) ?
+	 ADDRS_PER_INODE : ADDRS_PER_BLOCK;
+	 for (; ofs_in_node < end_offset; ofs_in_node++, len++)
+	 if (len == maxblocks || datablock_addr(dn->node_page,
+	 ofs_in_node) != blkaddr + len)
+	 goto out;
+	 f2fs_put_dnode(dn);
+
+	 if (len == maxblocks)
+	 return len;
+
+	 set_new_dnode(dn, dn->inode, NULL, NULL, 0);
+	 if (get_dnode_of_data(dn, pgofs + len, RDONLY_NODE))
+	 return len;
+	 ofs_in_node = dn->ofs_in_node;
+	}
+out:
+	f2fs_put_dnode(dn);
+	return len;
+}
+
 /**
  * This function should be used by the data read flow only where it
  * does not check the "create" flag that indicates block allocation.
@@ -377,7 +777,10 @@ static int get_data_block_ro(struct inode *inode, sector_t iblock,
 {
 	unsigned int blkbits = inode->i_sb->s_blocksize_bits;
 	unsigned maxblocks = bh_result->b_size >> blkbits;
+	struct extent_tree *et = &F2FS_I(inode)->ext;
+	unsigned long long version;
 	struct dnode_of_data dn;
+	unsigned int len;
 	pgoff_t pgofs;
 	int err;
 
@@ -387,6 +790,10 @@ static int get_data_block_ro(struct inode *inode, sector_t iblock,
 	if (check_extent_cache(inode, pgofs, bh_result))
 	 return 0;
 
+	read_lock(&et->lock);
+	version = et->version;
+	read_unlock(&et->lock);
+
 	/* When reading holes, we need its node page */
 	set_new_dnode(&dn, inode, NULL, NULL, 0);
 	err = get_dnode_of_data(&dn, pgofs, RDONLY_NODE);
@@ -396,26 +803,19 @@ static int get_data_block_ro(struct inode *inode, sector_t iblock,
 	/* It does not support data allocation */
 	BUG_ON(create);
 
-	if (dn.data_blkaddr != NEW_ADDR && dn.data_blkaddr != NULL_ADDR) {
-	 int i;
-	 unsigned int end_offset;
+	if (dn.data_blkaddr == NEW_ADDR || dn.data_blkaddr == NULL_ADDR) {
+	 f2fs_put_dnode(&dn);
+	 return 0;
+	}
 
-	 end_offset = IS_INODE(dn.node_page) ?
-	 ADDRS_PER_INODE :
-	 ADDRS_PER_BLOCK;
+	clear_buffer_new(bh_result);
+	map_bh(bh_result, inode->i_sb, dn.data_blkaddr);
 
-	 clear_buffer_new(bh_result);
+	/* Give more consecutive addresses for the read ahead */
+	len = count_contig_blocks(&dn, pgofs, maxblocks);
+	bh_result->b_size = (len << blkbits);
 
-	 /* Give more consecutive addresses for the read ahead */
-	 for (i = 0; i < end_offset - dn.ofs_in_node; i++)
-	 if (((datablock_addr(dn.node_page,
-	 dn.ofs_in_node + i))
-	 != (dn.data_blkaddr + i)) || maxblocks == i)
-	 break;
-	 map_bh(bh_result, inode->i_sb, dn.data_blkaddr);
-	 bh_result->b_size = (i << blkbits);
-	}
-	f2fs_put_dnode(&dn);
+	insert_extent_cache(inode, pgofs, bh_result->b_blocknr, len, version);
 	return 0;
 }
 
@@ -437,6 +837,7 @@ int do_write_data_page(struct page *page)
 	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
 	block_t old_blk_addr, new_blk_addr;
 	struct dnode_of_data dn;
+	unsigned int policy;
 	int err = 0;
 
 	set_new_dnode(&dn, inode, NULL, NULL, 0);
@@ -452,21 +853,28 @@ int do_write_data_page(struct page *page)
 
 	set_page_writeback(page);
 
+	if (old_blk_addr != NEW_ADDR)
+	 update_write_temp(inode);
+
 	/*
-	 * If current allocation needs SSR,
-	 * it had better in-place writes for updated data.
+	 * Updated data can be written in place according to the IPU policy,
+	 * which needs no node or NAT update and leaves no invalid block.
 	 */
+	policy = sbi->mount_opt.ipu_policy;
 	if (old_blk_addr != NEW_ADDR && !is_cold_data(page) &&
-	 need_inplace_update(inode)) {
+	 need_inplace_update(inode, page)) {
 	 rewrite_data_page(F2FS_SB(inode->i_sb), page,
 	 old_blk_addr);
+	 atomic_inc(&sbi->ipu_count[policy]);
 	} else {
 	 write_data_page(inode, page, &dn,
 	 old_blk_addr, &new_blk_addr);
 	 update_extent_cache(new_blk_addr, &dn);
 	 F2FS_I(inode)->data_version =
 	 le64_to_cpu(F2FS_CKPT(sbi)->checkpoint_ver);
+	 atomic_inc(&sbi->opu_count[policy]);
 	}
+	F2FS_I(inode)->last_write_index = page->index;
 out_writepage:
 	f2fs_put_dnode(&dn);
 	return err;
@@ -542,6 +950,243 @@ redirty_out:
 	return AOP_WRITEPAGE_ACTIVATE;
 }
 
+struct f2fs_write_batch {
+	struct inode *inode;
+	unsigned int nr;
+	pgoff_t done_index;	/* the index next to the last page seen */
+	struct page *pages[WRITE_BATCH_PAGES];
+	block_t blkaddrs[WRITE_BATCH_PAGES];
+};
+
+/**
+ * Return the first page index covered by the dnode which has the index
+ */
+static pgoff_t dnode_start_bidx(pgoff_t index)
+{
+	if (index < ADDRS_PER_INODE)
+	 return 0;
+	index -= ADDRS_PER_INODE;
+	return index - index % ADDRS_PER_BLOCK + ADDRS_PER_INODE;
+}
+
+/**
+ * Write back the locked pages of a batch through one dnode lookup and one
+ * DATA_WRITE lock. The pages are updated in place according to the IPU
+ * policy, or moved together to new blocks by write_data_pages().
+ */
+static void write_data_batch(struct f2fs_write_batch *wb,
+	 struct writeback_control *wbc)
+{
+	struct inode *inode = wb->inode;
+	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
+	unsigned int policy = sbi->mount_opt.ipu_policy;
+	pgoff_t start_index = wb->pages[0]->index;
+	unsigned int ofs_in_node, i, nr_opu = 0;
+	struct dnode_of_data dn;
+	int err;
+
+	mutex_lock_op(sbi, DATA_WRITE);
+
+	set_new_dnode(&dn, inode, NULL, NULL, 0);
+	err = get_dnode_of_data(&dn, start_index, RDONLY_NODE);
+	if (err) {
+	 mutex_unlock_op(sbi, DATA_WRITE);
+	 for (i = 0; i < wb->nr; i++) {
+	 /* The pages are already truncated */
+	 if (err != -ENOENT) {
+	 wbc->pages_skipped++;
+	 set_page_dirty(wb->pages[i]);
+	 }
+	 unlock_page(wb->pages[i]);
+	 }
+	 wb->nr = 0;
+	 return;
+	}
+	ofs_in_node = dn.ofs_in_node;
+
+	for (i = 0; i < wb->nr; i++) {
+	 struct page *page = wb->pages[i];
+	 block_t old_blk_addr = datablock_addr(dn.node_page,
+	 ofs_in_node + page->index - start_index);
+
+	 /* This page is already truncated */
+	 if (old_blk_addr == NULL_ADDR) {
+	 unlock_page(page);
+	 continue;
+	 }
+
+	 set_page_writeback(page);
+
+	 if (old_blk_addr != NEW_ADDR)
+	 update_write_temp(inode);
+
+	 if (old_blk_addr != NEW_ADDR && !is_cold_data(page) &&
+	 need_inplace_update(inode, page)) {
+	 rewrite_data_page(sbi, page, old_blk_addr);
+	 atomic_inc(&sbi->ipu_count[policy]);
+	 unlock_page(page);
+	 } else {
+	 wb->pages[nr_opu] = page;
+	 wb->blkaddrs[nr_opu++] = old_blk_addr;
+	 }
+	 F2FS_I(inode)->last_write_index = page->index;
+	}
+
+	if (nr_opu) {
+	 dn.ofs_in_node = ofs_in_node + wb->pages[0]->index - start_index;
+	 write_data_pages(inode, &dn, wb->pages, wb->blkaddrs, nr_opu);
+
+	 for (i = 0; i < nr_opu; i++) {
+	 dn.ofs_in_node = ofs_in_node +
+	 wb->pages[i]->index - start_index;
+	 update_extent_cache(wb->blkaddrs[i], &dn);
+	 }
+	 F2FS_I(inode)->data_version =
+	 le64_to_cpu(F2FS_CKPT(sbi)->checkpoint_ver);
+	 atomic_add(nr_opu, &sbi->opu_count[policy]);
+	}
+	f2fs_put_dnode(&dn);
+	mutex_unlock_op(sbi, DATA_WRITE);
+
+	for (i = 0; i < nr_opu; i++) {
+	 clear_cold_data(wb->pages[i]);
+	 unlock_page(wb->pages[i]);
+	}
+	wb->nr = 0;
+}
+
+/**
+ * Called by write_cache_pages() with a locked page, which is gathered into
+ * the batch of its dnode. The batch is written when the page cannot join it.
+ */
+static int __f2fs_writepage(struct page *page, struct writeback_control *wbc,
+	 void *data)
+{
+	struct f2fs_write_batch *wb = data;
+	struct inode *inode = page->mapping->host;
+	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
+	loff_t i_size = i_size_read(inode);
+	const pgoff_t end_index = ((unsigned long long) i_size)
+	 >> PAGE_CACHE_SHIFT;
+	unsigned offset;
+
+	wb->done_index = page->index + 1;
+
+	if (page->index >= end_index) {
+	 /*
+	 * If the offset is out-of-range of file size,
+	 * this page does not have to be written to disk.
+	 */
+	 offset = i_size & (PAGE_CACHE_SIZE - 1);
+	 if ((page->index >= end_index + 1) || !offset) {
+	 unlock_page(page);
+	 return 0;
+	 }
+	 zero_user_segment(page, offset, PAGE_CACHE_SIZE);
+	}
+
+	if (sbi->por_doing) {
+	 wbc->pages_skipped++;
+	 set_page_dirty(page);
+	 return AOP_WRITEPAGE_ACTIVATE;
+	}
+
+	if (wb->nr && (wb->nr == WRITE_BATCH_PAGES ||
+	 dnode_start_bidx(page->index) !=
+	 dnode_start_bidx(wb->pages[0]->index)))
+	 write_data_batch(wb, wbc);
+
+	wb->pages[wb->nr++] = page;
+	return 0;
+}
+
+/**
+ * A batch keeps its pages locked across __f2fs_writepage() calls, so pages
+ * must be locked in ascending order only. write_cache_pages() wraps around
+ * to index 0 by itself for range_cyclic, which would lock low pages while
+ * the batch still holds high ones. So run the two ranges here instead, and
+ * write the batch out in between.
+ */
+static int f2fs_write_cache_pages(struct address_space *mapping,
+	 struct writeback_control *wbc)
+{
+	struct f2fs_write_batch wb;
+	loff_t range_start = wbc->range_start;
+	loff_t range_end = wbc->range_end;
+	pgoff_t writeback_index;
+	int ret;
+
+	wb.inode = mapping->host;
+	wb.nr = 0;
+
+	if (!wbc->range_cyclic) {
+	 ret = write_cache_pages(mapping, wbc, __f2fs_writepage, &wb);
+	 if (wb.nr)
+	 write_data_batch(&wb, wbc);
+	 return ret;
+	}
+
+	writeback_index = mapping->writeback_index;
+	wb.done_index = writeback_index;
+
+	wbc->range_cyclic = 0;
+	wbc->range_start = (loff_t)writeback_index << PAGE_CACHE_SHIFT;
+	wbc->range_end = LLONG_MAX;
+	ret = write_cache_pages(mapping, wbc, __f2fs_writepage, &wb);
+	if (wb.nr)
+	 write_data_batch(&wb, wbc);
+
+	if (!ret && writeback_index && wbc->nr_to_write > 0) {
+	 wbc->range_start = 0;
+	 wbc->range_end = ((loff_t)writeback_index << PAGE_CACHE_SHIFT) - 1;
+	 ret = write_cache_pages(mapping, wbc, __f2fs_writepage, &wb);
+	 if (wb.nr)
+	 write_data_batch(&wb, wbc);
+	}
+
+	mapping->writeback_index = wb.done_index;
+	wbc->range_cyclic = 1;
+	wbc->range_start = range_start;
+	wbc->range_end = range_end;
+	return ret;
+}
+
+/**
+ * Background writeback leaves a file having fewer dirty pages than a batch
+ * for up to bg_write_defer msecs since it got dirty, so that the small files
+ * are written together later instead of scattering among the large ones.
+ * Background writeback only runs over the dirty threshold, so this is off
+ * by default not to hold back the flusher from small-file workloads.
+ */
+static bool should_defer_writeback(struct inode *inode,
+	 struct writeback_control *wbc)
+{
+	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
+	unsigned int defer = sbi->mount_opt.bg_write_defer;
+	struct pagevec pvec;
+	pgoff_t index = 0;
+	unsigned int nr_dirty = 0, nr;
+
+	if (!defer)
+	 return false;
+	if (!wbc->for_background || wbc->sync_mode != WB_SYNC_NONE)
+	 return false;
+	if (time_after_eq(jiffies,
+	 F2FS_I(inode)->dirty_start + msecs_to_jiffies(defer)))
+	 return false;
+
+	pagevec_init(&pvec, 0);
+	while (nr_dirty < WRITE_BATCH_PAGES) {
+	 nr = pagevec_lookup_tag(&pvec, inode->i_mapping, &index,
+	 PAGECACHE_TAG_DIRTY, PAGEVEC_SIZE);
+	 if (!nr)
+	 break;
+	 nr_dirty += nr;
+	 pagevec_release(&pvec);
+	}
+	return nr_dirty < WRITE_BATCH_PAGES;
+}
+
 #define MAX_DESIRED_PAGES_WP	4096
 
 int f2fs_write_data_pages(struct address_space *mapping,
@@ -549,24 +1194,46 @@ int f2fs_write_data_pages(struct address_space *mapping,
 {
 	struct inode *inode = mapping->host;
 	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
+	struct blk_plug plug;
 	int ret;
 	long excess_nrtw = 0, desired_nrtw;
 
-	if (wbc->nr_to_write < MAX_DESIRED_PAGES_WP) {
-	 desired_nrtw = MAX_DESIRED_PAGES_WP;
+	if (S_ISREG(inode->i_mode) && should_defer_writeback(inode, wbc)) {
+	 atomic_inc(&sbi->wb_deferred);
+	 return 0;
+	}
+
+	/* Let a file fill at least a whole section of its log */
+	desired_nrtw = max_t(long, MAX_DESIRED_PAGES_WP,
+	 sbi->blocks_per_seg * sbi->segs_per_sec);
+	if (wbc->nr_to_write < desired_nrtw) {
 	 excess_nrtw = desired_nrtw - wbc->nr_to_write;
 	 wbc->nr_to_write = desired_nrtw;
 	}
 
-	if (!S_ISDIR(inode->i_mode))
-	 mutex_lock(&sbi->writepages);
-	ret = generic_writepages(mapping, wbc);
-	if (!S_ISDIR(inode->i_mode))
-	 mutex_unlock(&sbi->writepages);
+	/*
+	 * Plug the whole batch including the last bios of the logs.
+	 * Writeback of different inodes runs concurrently, since each batch
+	 * of an inode gets consecutive blocks in its log anyway. Writeback of
+	 * the same inode is serialized, so that the flusher and fsync do not
+	 * hold batches of locked pages against each other.
+	 */
+	blk_start_plug(&plug);
+	if (S_ISREG(inode->i_mode)) {
+	 mutex_lock(&F2FS_I(inode)->writepages);
+	 ret = f2fs_write_cache_pages(mapping, wbc);
+	 mutex_unlock(&F2FS_I(inode)->writepages);
+	} else
+	 ret = generic_writepages(mapping, wbc);
 	f2fs_submit_bio(sbi, DATA, (wbc->sync_mode == WB_SYNC_ALL));
+	blk_finish_plug(&plug);
 
 	remove_dirty_dir_inode(inode);
 
+	/* Cleaning may lock data pages, so do not run it inside batches */
+	if (S_ISREG(inode->i_mode))
+	 f2fs_balance_fs(sbi);
+
 	wbc->nr_to_write -= excess_nrtw;
 	return ret;
 }
@@ -641,18 +1308,237 @@ static int f2fs_write_begin(struct file *file, struct address_space *mapping,
 	return 0;
 }
 
+/**
+ * The new blocks of a direct write, which are switched into the dnode only
+ * after the write completes.
+ */
+struct dio_extent {
+	struct list_head list;
+	pgoff_t fofs;	 /* start file offset */
+	block_t blk_addr;	/* start address of the new blocks */
+	unsigned int len;	/* number of blocks */
+	/* holes reserved for the blocks */
+	unsigned long reserved[BITS_TO_LONGS(ADDRS_PER_BLOCK)];
+};
+
+/**
+ * Direct writes never go through the page cache, so the blocks of a whole
+ * request are allocated here at once in LFS manner: holes are reserved, and
+ * then the consecutive free blocks of one data log are taken within a dnode.
+ * The dnode keeps the old blocks until complete_dio_write().
+ */
+static int get_data_block_dio(struct inode *inode, sector_t iblock,
+	 struct buffer_head *bh_result, int create)
+{
+	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
+	unsigned int blkbits = inode->i_sb->s_blocksize_bits;
+	unsigned int maxblocks = bh_result->b_size >> blkbits;
+	unsigned int end_offset, ofs_in_node, count, nr, i;
+	struct dnode_of_data dn;
+	struct dio_extent *de;
+	block_t blkaddr, new_blkaddr;
+	bool overwrite = false, released = false;
+	pgoff_t pgofs;
+	int err;
+
+	if (!create)
+	 return get_data_block_ro(inode, iblock, bh_result, create);
+
+	pgofs = (pgoff_t)(iblock >> (PAGE_CACHE_SHIFT - blkbits));
+
+	de = kzalloc(sizeof(struct dio_extent), GFP_NOFS);
+	if (!de)
+	 return -ENOMEM;
+
+	mutex_lock_op(sbi, DATA_NEW);
+
+	set_new_dnode(&dn, inode, NULL, NULL, 0);
+	err = get_dnode_of_data(&dn, pgofs, 0);
+	if (err)
+	 goto unlock_out;
+
+	end_offset = IS_INODE(dn.node_page) ? ADDRS_PER_INODE : ADDRS_PER_BLOCK;
+	ofs_in_node = dn.ofs_in_node;
+	count = min(maxblocks, end_offset - ofs_in_node);
+
+	for (i = 0; i < count; i++) {
+	 dn.ofs_in_node = ofs_in_node + i;
+	 blkaddr = datablock_addr(dn.node_page, dn.ofs_in_node);
+	 if (blkaddr != NULL_ADDR) {
+	 if (blkaddr != NEW_ADDR)
+	 overwrite = true;
+	 continue;
+	 }
+	 err = reserve_new_block(&dn);
+	 if (err) {
+	 count = i;
+	 break;
+	 }
+	 __set_bit(i, de->reserved);
+	}
+	dn.ofs_in_node = ofs_in_node;
+	if (!count)
+	 goto put_out;
+	err = 0;
+
+	if (overwrite)
+	 update_write_temp(inode);
+
+	nr = allocate_data_blocks(sbi, &dn, count, &new_blkaddr);
+
+	/* Give back the holes reserved beyond the allocated blocks */
+	for (i = nr; i < count; i++) {
+	 if (!test_bit(i, de->reserved))
+	 continue;
+	 __clear_bit(i, de->reserved);
+	 dn.ofs_in_node = ofs_in_node + i;
+	 update_extent_cache(NULL_ADDR, &dn);
+	 dec_valid_block_count(sbi, inode, 1);
+	 released = true;
+	}
+	if (released)
+	 sync_inode_page(&dn);
+
+	de->fofs = pgofs;
+	de->blk_addr = new_blkaddr;
+	de->len = nr;
+	list_add_tail(&de->list, &F2FS_I(inode)->dio_list);
+	de = NULL;
+
+	map_bh(bh_result, inode->i_sb, new_blkaddr);
+	bh_result->b_size = (nr << blkbits);
+put_out:
+	f2fs_put_dnode(&dn);
+unlock_out:
+	mutex_unlock_op(sbi, DATA_NEW);
+	kfree(de);
+	return err;
+}
+
+/**
+ * Switch the blocks of a direct write into the dnodes after the write has
+ * completed, so that neither readers nor fsync see them before their data.
+ * The blocks beyond the written bytes are freed, and so are the holes which
+ * were reserved for them.
+ */
+static void complete_dio_write(struct inode *inode, loff_t offset,
+	 ssize_t written)
+{
+	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+	pgoff_t end = 0;
+	struct dio_extent *de, *tmp;
+	struct dnode_of_data dn;
+	unsigned int ofs_in_node, i;
+	bool released;
+	int err;
+
+	if (written > 0)
+	 end = (offset + written) >> PAGE_CACHE_SHIFT;
+
+	list_for_each_entry_safe(de, tmp, &fi->dio_list, list) {
+	 mutex_lock_op(sbi, DATA_NEW);
+
+	 set_new_dnode(&dn, inode, NULL, NULL, 0);
+	 err = get_dnode_of_data(&dn, de->fofs, RDONLY_NODE);
+	 if (err) {
+	 /* Nobody maps the new blocks, so just free them */
+	 for (i = 0; i < de->len; i++)
+	 invalidate_blocks(sbi, de->blk_addr + i);
+	 goto next;
+	 }
+
+	 ofs_in_node = dn.ofs_in_node;
+	 released = false;
+	 for (i = 0; i < de->len; i++) {
+	 block_t old_blkaddr;
+
+	 dn.ofs_in_node = ofs_in_node + i;
+	 old_blkaddr = datablock_addr(dn.node_page, dn.ofs_in_node);
+
+	 if (de->fofs + i < end && old_blkaddr != NULL_ADDR) {
+	 update_extent_cache(de->blk_addr + i, &dn);
+	 invalidate_blocks(sbi, old_blkaddr);
+	 continue;
+	 }
+
+	 invalidate_blocks(sbi, de->blk_addr + i);
+	 if (test_bit(i, de->reserved) && old_blkaddr == NEW_ADDR) {
+	 update_extent_cache(NULL_ADDR, &dn);
+	 dec_valid_block_count(sbi, inode, 1);
+	 released = true;
+	 }
+	 }
+	 if (released)
+	 sync_inode_page(&dn);
+	 f2fs_put_dnode(&dn);
+next:
+	 mutex_unlock_op(sbi, DATA_NEW);
+	 list_del(&de->list);
+	 kfree(de);
+	}
+
+	if (end > (offset >> PAGE_CACHE_SHIFT))
+	 fi->data_version = le64_to_cpu(F2FS_CKPT(sbi)->checkpoint_ver);
+}
+
+/**
+ * Direct writes should be aligned to the f2fs block size, since a partially
+ * written block cannot be moved to a new address without a read-modify-write.
+ */
+static bool dio_aligned(struct inode *inode, const struct iovec *iov,
+	 loff_t offset, unsigned long nr_segs)
+{
+	unsigned int blocksize_mask = inode->i_sb->s_blocksize - 1;
+	unsigned long seg;
+
+	if (offset & blocksize_mask)
+	 return false;
+	for (seg = 0; seg < nr_segs; seg++)
+	 if (iov[seg].iov_len & blocksize_mask)
+	 return false;
+	return true;
+}
+
 static ssize_t f2fs_direct_IO(int rw, struct kiocb *iocb,
 	 const struct iovec *iov, loff_t offset, unsigned long nr_segs)
 {
 	struct file *file = iocb->ki_filp;
 	struct inode *inode = file->f_mapping->host;
+	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+	ssize_t ret;
+
+	if (rw == READ) {
+	 /* Synchronized with the cleaner moving the blocks */
+	 down_read(&fi->dio_rwsem);
+	 ret = blockdev_direct_IO(rw, iocb, inode, iov, offset,
+	 nr_segs, get_data_block_ro);
+	 up_read(&fi->dio_rwsem);
+	 return ret;
+	}
 
-	if (rw == WRITE)
+	/*
+	 * Fall back to buffered writes for unaligned and asynchronous ones.
+	 * The latter would complete after the checkpoint is unblocked.
+	 */
+	if (!is_sync_kiocb(iocb) || !dio_aligned(inode, iov, offset, nr_segs))
 	 return 0;
 
-	/* Needs synchronization with the cleaner */
-	return blockdev_direct_IO(rw, iocb, inode, iov, offset, nr_segs,
-	 get_data_block_ro);
+	f2fs_balance_fs(sbi);
+
+	/*
+	 * A checkpoint should not cover the blocks before they are written.
+	 * i_mutex keeps dio_list to this write.
+	 */
+	down_read(&sbi->dio_sem);
+	down_read(&fi->dio_rwsem);
+	ret = __blockdev_direct_IO(rw, iocb, inode, inode->i_sb->s_bdev, iov,
+	 offset, nr_segs, get_data_block_dio, NULL, NULL, 0);
+	complete_dio_write(inode, offset, ret);
+	up_read(&fi->dio_rwsem);
+	up_read(&sbi->dio_sem);
+	return ret;
 }
 
 static void f2fs_invalidate_data_page(struct page *page, unsigned long offset)
@@ -679,6 +1565,9 @@ static int f2fs_set_data_page_dirty(struct page *page)
 
 	SetPageUptodate(page);
 	if (!PageDirty(page)) {
+	 if (S_ISREG(inode->i_mode) &&
+	 !mapping_tagged(mapping, PAGECACHE_TAG_DIRTY))
+	 F2FS_I(inode)->dirty_start = jiffies;
 	 __set_page_dirty_nobuffers(page);
 	 set_dirty_dir_page(inode, page);
 	 return 1;
@@ -698,3 +1587,37 @@ const struct address_space_operations f2fs_dblock_aops = {
 	.releasepage	= f2fs_release_data_page,
 	.direct_IO	= f2fs_direct_IO,
 };
+
+static int f2fs_shrink_extent_cache(struct shrinker *shrink,
+	 struct shrink_control *sc)
+{
+	struct f2fs_sb_info *sbi = container_of(shrink,
+	 struct f2fs_sb_info, extent_shrinker);
+
+	if (sc->nr_to_scan)
+	 __shrink_extent_nodes(sbi, sc->nr_to_scan, NULL);
+	return atomic_read(&sbi->total_ext_node);
+}
+
+void init_extent_cache_info(struct f2fs_sb_info *sbi)
+{
+	INIT_LIST_HEAD(&sbi->extent_list);
+	spin_lock_init(&sbi->extent_lock);
+	atomic_set(&sbi->total_ext_node, 0);
+	sbi->extent_shrinker.shrink = f2fs_shrink_extent_cache;
+	sbi->extent_shrinker.seeks = DEFAULT_SEEKS;
+}
+
+int create_extent_cache(void)
+{
+	extent_node_slab = f2fs_kmem_cache_create("f2fs_extent_node",
+	 sizeof(struct extent_node), NULL);
+	if (unlikely(!extent_node_slab))
+	 return -ENOMEM;
+	return 0;
+}
+
+void destroy_extent_cache(void)
+{
+	kmem_cache_destroy(extent_node_slab);
+}
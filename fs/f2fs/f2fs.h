@@ -17,6 +17,24 @@
 #include <linux/version.h>
 #include <linux/slab.h>
 #include <linux/crc32.h>
+#include <linux/rbtree.h>
+
+/**
+ * For ioctls
+ */
+#define F2FS_IOCTL_MAGIC	 0xf5
+#define F2FS_IOC_GET_TEMPERATURE	_IOR(F2FS_IOCTL_MAGIC, 1, __u32)
+#define F2FS_IOC_SET_TEMPERATURE	_IOW(F2FS_IOCTL_MAGIC, 2, __u32)
+
+/*
+ * Write temperature hints of a file kept in i_advise.
+ * With F2FS_TEMP_AUTO, the data log is chosen by the update intervals.
+ */
+#define F2FS_TEMP_AUTO	 0
+#define F2FS_TEMP_HOT	 1
+#define F2FS_TEMP_WARM	 2
+#define F2FS_TEMP_COLD	 3
+#define F2FS_TEMP_MASK	 0x03
 
 /**
  * For mount options
@@ -41,6 +59,12 @@ typedef u32 nid_t;
 
 struct f2fs_mount_info {
 	unsigned int	opt;
+	unsigned int	data_heads;	/* # of data logs per temperature */
+	unsigned int	ipu_policy;	/* in-place update policy */
+	unsigned int	min_ipu_util;	/* utilization threshold for IPU */
+	unsigned int	gc_max_kbps;	/* bandwidth cap of background GC */
+	unsigned int	bg_write_defer;	/* msecs to defer small files, 0: off */
+	unsigned int	max_extents;	/* max. # of cached extent nodes */
 };
 
 static inline __u32 f2fs_crc32(void *buff, size_t len)
@@ -56,6 +80,7 @@ static inline bool f2fs_crc_valid(__u32 blk_crc, void *buff, size_t buff_size)
 /**
  * For checkpoint manager
  */
+#define CP_SEGMAP_FLAG	 0x00000010
 #define CP_ERROR_FLAG	 0x00000008
 #define CP_COMPACT_SUM_FLAG	0x00000004
 #define CP_ORPHAN_PRESENT_FLAG	0x00000002
@@ -110,11 +135,38 @@ static inline int update_sits_in_cursum(struct f2fs_summary_block *rs, int i)
 #define XATTR_NODE_OFFSET	(-1)
 #define RDONLY_NODE	 1
 
+#define DEF_MAX_EXTENTS	65536	/* default max. # of cached extent nodes */
+/* a node moved to the LRU tail within this interval is not moved again */
+#define EXTENT_LRU_INTERVAL	(HZ / 10)
+
 struct extent_info {
-	rwlock_t ext_lock;
-	unsigned int fofs;
-	u32 blk_addr;
-	unsigned int len;
+	unsigned int fofs;	/* start offset in a file */
+	u32 blk_addr;	/* start block address of the extent */
+	unsigned int len;	/* length of the extent */
+};
+
+struct extent_node {
+	struct rb_node rb_node;	/* rb node located in rb-tree */
+	struct list_head list;	/* node in the global LRU list */
+	struct extent_tree *et;	/* extent tree having this node */
+	struct extent_info ei;	/* extent info */
+	unsigned long access;	/* jiffies moved to the LRU tail */
+};
+
+/**
+ * The extents of an inode are kept in a rb-tree by file offset.
+ * The largest one is also kept in i_ext of the inode on disk, but it is
+ * copied into the inode page lazily. The inode page is updated at once only
+ * when the extent in it becomes stale.
+ */
+struct extent_tree {
+	rwlock_t lock;
+	struct rb_root root;	/* root of the extent nodes */
+	struct extent_node *cached_en;	/* the extent found lastly */
+	struct extent_info largest;	/* the largest extent */
+	struct extent_info disk;	/* the extent in the inode page */
+	unsigned int count;	/* # of extent nodes */
+	unsigned long long version;	/* increased at every update */
 };
 
 struct f2fs_inode_info {
@@ -127,29 +179,28 @@ struct f2fs_inode_info {
 	f2fs_hash_t chash;
 	unsigned int clevel;
 	nid_t i_xattr_nid;
-	struct extent_info ext;
+	struct extent_tree ext;	/* cached extents */
 	umode_t i_acl_mode;
-	unsigned char is_cold;	 /* If true, this is cold data */
+	unsigned char i_advise;	 /* file hints such as temperature */
+	pgoff_t last_write_index;	/* the last page index written back */
+	unsigned long last_update;	/* jiffies of the last data overwrite */
+	unsigned long update_interval;	/* average interval of overwrites */
+	struct rw_semaphore dio_rwsem;	/* excludes GC from direct I/O */
+	struct mutex writepages;	/* serializes writepages of the inode */
+	struct list_head dio_list;	/* new blocks of a direct write */
+	struct task_struct *fsync_task;	/* task writing back for fsync */
+	unsigned long dirty_start;	/* jiffies when data got dirty */
 };
 
-static inline void get_extent_info(struct extent_info *ext,
-	 struct f2fs_extent i_ext)
-{
-	write_lock(&ext->ext_lock);
-	ext->fofs = le32_to_cpu(i_ext.fofs);
-	ext->blk_addr = le32_to_cpu(i_ext.blk_addr);
-	ext->len = le32_to_cpu(i_ext.len);
-	write_unlock(&ext->ext_lock);
-}
-
-static inline void set_raw_extent(struct extent_info *ext,
+static inline void set_raw_extent(struct extent_tree *et,
 	 struct f2fs_extent *i_ext)
 {
-	read_lock(&ext->ext_lock);
-	i_ext->fofs = cpu_to_le32(ext->fofs);
-	i_ext->blk_addr = cpu_to_le32(ext->blk_addr);
-	i_ext->len = cpu_to_le32(ext->len);
-	read_unlock(&ext->ext_lock);
+	write_lock(&et->lock);
+	i_ext->fofs = cpu_to_le32(et->largest.fofs);
+	i_ext->blk_addr = cpu_to_le32(et->largest.blk_addr);
+	i_ext->len = cpu_to_le32(et->largest.len);
+	et->disk = et->largest;
+	write_unlock(&et->lock);
 }
 
 struct f2fs_nm_info {
@@ -167,8 +218,12 @@ struct f2fs_nm_info {
 
 	unsigned int fcnt;	 /* the number of free node id */
 	struct mutex build_lock;	/* lock for build free nids */
-	struct list_head free_nid_list;	/* free node list */
+	struct radix_tree_root free_nid_root;	/* index of all free nids */
+	struct list_head free_nid_list;	/* free node list (NID_NEW) */
+	struct list_head alloc_nid_list;	/* allocated nids (NID_ALLOC) */
 	spinlock_t free_nid_list_lock;	/* Protect pre-free nid list */
+	unsigned long *free_nid_bitmap;	/* free nids as of last checkpoint */
+	unsigned short *free_nid_count;	/* free nids in each NAT block */
 
 	spinlock_t stat_lock;	 /* Protect status variables */
 
@@ -213,6 +268,7 @@ static inline void set_new_dnode(struct dnode_of_data *dn, struct inode *inode,
 #define	NR_CURSEG_DATA_TYPE	(3)
 #define NR_CURSEG_NODE_TYPE	(3)
 #define NR_CURSEG_TYPE	(NR_CURSEG_DATA_TYPE + NR_CURSEG_NODE_TYPE)
+#define MAX_DATA_HEADS	(8)	/* max. # of data logs per temperature */
 
 enum {
 	CURSEG_HOT_DATA = 0,
@@ -234,8 +290,14 @@ struct f2fs_sm_info {
 	/* Dirty segments list information for GC victim */
 	struct dirty_seglist_info *dirty_info;
 
+	/* Pending discard extents information */
+	struct discard_info *discard_info;
+
 	/* Current working segments(i.e. logging point) information array */
 	struct curseg_info *curseg_array;
+	unsigned int nr_cursegs;	/* # of entries in curseg_array */
+	unsigned int nr_data_heads;	/* # of data logs per temperature */
+	struct bio_set *bio_set;	/* reserved write bios */
 
 	/* list head of all under-writeback pages for flush handling */
 	struct list_head	wblist_head;
@@ -322,6 +384,72 @@ enum page_type {
 	META_FLUSH,
 };
 
+/*
+ * A write bio under assembly. Each log builds its own bio, and the writes
+ * outside logs such as META and in-place updates use sbi->write_io.
+ */
+struct f2fs_bio_info {
+	struct bio *bio;	 /* bio under assembly */
+	sector_t last_block_in_bio;	/* last block number */
+	struct mutex io_mutex;	 /* mutex for bio assembly */
+	int io_class;	 /* I/O class of the bio */
+};
+
+/*
+ * Writes are classified by who issues them, and each class gets its own
+ * bios. GC writes are submitted with a lower priority.
+ */
+enum io_class {
+	F2FS_IO_FG,	/* foreground writes */
+	F2FS_IO_GC,	/* blocks moved by GC */
+	F2FS_IO_CP,	/* checkpoint */
+	NR_IO_CLASS,
+};
+
+struct f2fs_io_stat {
+	atomic_t bios;	 /* # of completed bios */
+	atomic64_t bytes;	 /* bytes written by them */
+	atomic64_t lat_us;	 /* sum of their latencies */
+	unsigned int max_lat_us;	/* max. latency */
+};
+
+/*
+ * The below are the phases of fill_super() whose elapsed time is kept.
+ * MOUNT_SIT_ENTRIES is a part of MOUNT_SEGMENT_MANAGER.
+ */
+enum mount_phase {
+	MOUNT_CHECKPOINT,	/* for loading a valid checkpoint */
+	MOUNT_SEGMENT_MANAGER,	/* for build_segment_manager() */
+	MOUNT_SIT_ENTRIES,	/* for loading SIT entries */
+	MOUNT_NODE_MANAGER,	/* for build_node_manager() */
+	MOUNT_ROLL_FORWARD,	/* for recovering fsynced data */
+	MOUNT_TOTAL,	 /* for the whole fill_super() */
+	NR_MOUNT_PHASE,
+};
+
+/*
+ * The below are the policies deciding whether an updated data page is
+ * written in place (IPU) instead of being appended to a log (OPU).
+ * F2FS_IPU_NEVER	Always append updated data.
+ * F2FS_IPU_ALWAYS	Always rewrite updated data in place.
+ * F2FS_IPU_UTIL	Rewrite in place once utilization exceeds min_ipu_util
+ *	 while the logs need SSR.
+ * F2FS_IPU_FSYNC	Rewrite in place the pages written back by fsync().
+ * F2FS_IPU_SEQ	 Rewrite in place sequential overwrites of a file.
+ */
+enum ipu_policy {
+	F2FS_IPU_NEVER,
+	F2FS_IPU_ALWAYS,
+	F2FS_IPU_UTIL,
+	F2FS_IPU_FSYNC,
+	F2FS_IPU_SEQ,
+	NR_IPU_POLICY,
+};
+
+#define DEF_IPU_POLICY	 F2FS_IPU_NEVER
+#define DEF_MIN_IPU_UTIL	70
+#define NULL_WRITE_INDEX	((pgoff_t)-1)	/* no page written back yet */
+
 struct f2fs_sb_info {
 	struct super_block *sb;	 /* Pointer to VFS super block */
 	int s_dirty;
@@ -334,6 +462,7 @@ struct f2fs_sb_info {
 	struct mutex orphan_inode_mutex;
 	spinlock_t dir_inode_lock;
 	struct mutex cp_mutex;
+	struct rw_semaphore dio_sem;	 /* excludes CP from direct writes */
 	/* orphan Inode list to be written in Journal block during CP */
 	struct list_head orphan_inode_list;
 	struct list_head dir_inode_list;
@@ -358,6 +487,8 @@ struct f2fs_sb_info {
 	unsigned int segment_count[2];
 	unsigned int block_count[2];
 	unsigned int last_victim[2];
+	unsigned int log_segs[NR_CURSEG_TYPE];	/* # of filled segments */
+	unsigned long long log_runs[NR_CURSEG_TYPE];	/* # of file runs in them */
 	block_t user_block_count;
 	block_t total_valid_block_count;
 	block_t alloc_valid_block_count;
@@ -372,9 +503,44 @@ struct f2fs_sb_info {
 	/* related to SM */
 	struct f2fs_sm_info *sm_info;	 /* Segment Manager
 	 information */
-	int total_hit_ext, read_hit_ext;
 	int rr_flush;
 
+	/* for the extent cache */
+	struct list_head extent_list;	/* LRU list of all extent nodes */
+	spinlock_t extent_lock;	/* protects extent_list */
+	atomic_t total_ext_node;	/* # of extent nodes */
+	atomic_t total_hit_ext, read_hit_ext;	/* # of lookups and hits */
+	atomic_t evicted_ext;	/* # of extent nodes evicted */
+	atomic_t lazy_ext;	/* # of inode page updates deferred */
+	struct shrinker extent_shrinker;
+
+	/* # of in-place and out-of-place data writes per IPU policy */
+	atomic_t ipu_count[NR_IPU_POLICY];
+	atomic_t opu_count[NR_IPU_POLICY];
+
+	/* # of data blocks routed to each data log by the classifier */
+	atomic_t temp_count[NR_CURSEG_DATA_TYPE];
+
+	/* # of small files left by background writeback */
+	atomic_t wb_deferred;
+
+	/* write statistics per I/O class */
+	struct f2fs_io_stat io_stat[NR_IO_CLASS];
+	unsigned int gc_throttled;	/* # of BG GC rounds over the cap */
+	struct task_struct *gc_task;	/* task running f2fs_gc() */
+	bool gc_fg;			/* gc_task is doing foreground GC */
+	struct task_struct *cp_task;	/* task doing a checkpoint */
+
+	/* checkpoint latency and meta page runs, updated under cp_mutex */
+	unsigned int cp_count;
+	unsigned long long cp_total_us;
+	unsigned int cp_max_us;
+	unsigned long long meta_written;	/* # of meta pages written */
+	unsigned long long meta_runs;	/* # of contiguous runs of them */
+
+	/* elapsed time of mount phases in usecs */
+	unsigned long long mount_time[NR_MOUNT_PHASE];
+
 	/* related to GC */
 	struct proc_dir_entry *s_proc;
 	struct f2fs_gc_info *gc_info;	 /* Garbage Collector
@@ -382,7 +548,6 @@ struct f2fs_sb_info {
 	struct mutex gc_mutex;	 /* mutex for GC */
 	struct mutex fs_lock[NR_LOCK_TYPE];	/* mutex for GP */
 	struct mutex write_inode;	 /* mutex for write inode */
-	struct mutex writepages;	 /* mutex for writepages() */
 	struct f2fs_gc_kthread	*gc_thread;	/* GC thread */
 	int bg_gc;
 	int last_gc_status;
@@ -391,9 +556,7 @@ struct f2fs_sb_info {
 	struct inode *node_inode;
 	struct inode *meta_inode;
 
-	struct bio *bio[NR_PAGE_TYPE];
-	sector_t last_block_in_bio[NR_PAGE_TYPE];
-	struct rw_semaphore bio_sem;
+	struct f2fs_bio_info write_io[NR_PAGE_TYPE];	/* for untyped writes */
 	void *ckpt_mutex;	 /* mutex protecting
 	 node buffer */
 	spinlock_t stat_lock;	 /* lock for handling the number
@@ -449,6 +612,11 @@ static inline struct dirty_seglist_info *DIRTY_I(struct f2fs_sb_info *sbi)
 	return (struct dirty_seglist_info *)(SM_I(sbi)->dirty_info);
 }
 
+static inline struct discard_info *DISCARD_I(struct f2fs_sb_info *sbi)
+{
+	return (struct discard_info *)(SM_I(sbi)->discard_info);
+}
+
 static inline void F2FS_SET_SB_DIRT(struct f2fs_sb_info *sbi)
 {
 	sbi->s_dirty = 1;
@@ -538,6 +706,12 @@ static inline void dec_page_count(struct f2fs_sb_info *sbi, int count_type)
 	atomic_dec(&sbi->nr_pages[count_type]);
 }
 
+static inline void sub_page_count(struct f2fs_sb_info *sbi, int count_type,
+	 int nr)
+{
+	atomic_sub(nr, &sbi->nr_pages[count_type]);
+}
+
 static inline void inode_dec_dirty_dents(struct inode *inode)
 {
 	atomic_dec(&F2FS_I(inode)->dirty_dents);
@@ -776,6 +950,16 @@ enum {
 	FI_NO_ALLOC,
 };
 
+static inline int get_file_temp(struct f2fs_inode_info *fi)
+{
+	return fi->i_advise & F2FS_TEMP_MASK;
+}
+
+static inline void set_file_temp(struct f2fs_inode_info *fi, int temp)
+{
+	fi->i_advise = (fi->i_advise & ~F2FS_TEMP_MASK) | temp;
+}
+
 static inline void set_inode_flag(struct f2fs_inode_info *fi, int flag)
 {
 	set_bit(flag, &fi->flags);
@@ -815,6 +999,7 @@ void f2fs_truncate(struct inode *);
 int f2fs_setattr(struct dentry *, struct iattr *);
 int truncate_hole(struct inode *, pgoff_t, pgoff_t);
 long f2fs_ioctl(struct file *, unsigned int, unsigned long);
+int f2fs_set_file_temp(struct inode *, unsigned int);
 
 /**
  * inode.c
@@ -864,6 +1049,7 @@ int remove_inode_page(struct inode *);
 int new_inode_page(struct inode *, struct dentry *);
 struct page *new_node_page(struct dnode_of_data *, unsigned int);
 void ra_node_page(struct f2fs_sb_info *, nid_t);
+void ra_node_pages(struct f2fs_sb_info *, nid_t *, int);
 struct page *get_node_page(struct f2fs_sb_info *, pgoff_t);
 struct page *get_node_page_ra(struct page *, int);
 void sync_inode_page(struct dnode_of_data *);
@@ -890,9 +1076,9 @@ void invalidate_blocks(struct f2fs_sb_info *, block_t);
 void locate_dirty_segment(struct f2fs_sb_info *, unsigned int);
 void clear_prefree_segments(struct f2fs_sb_info *);
 int npages_for_summary_flush(struct f2fs_sb_info *);
+int npages_for_segmap_summary(struct f2fs_sb_info *);
 void allocate_new_segments(struct f2fs_sb_info *);
 struct page *get_sum_page(struct f2fs_sb_info *, unsigned int);
-struct bio *f2fs_bio_alloc(struct block_device *, sector_t, int, gfp_t);
 void f2fs_submit_bio(struct f2fs_sb_info *, enum page_type, bool sync);
 int write_meta_page(struct f2fs_sb_info *, struct page *,
 	 struct writeback_control *);
@@ -900,19 +1086,32 @@ void write_node_page(struct f2fs_sb_info *, struct page *, unsigned int,
 	 block_t, block_t *);
 void write_data_page(struct inode *, struct page *, struct dnode_of_data*,
 	 block_t, block_t *);
+void write_data_pages(struct inode *, struct dnode_of_data *,
+	 struct page **, block_t *, unsigned int);
 void rewrite_data_page(struct f2fs_sb_info *, struct page *, block_t);
+unsigned int allocate_data_blocks(struct f2fs_sb_info *,
+	 struct dnode_of_data *, unsigned int, block_t *);
 void recover_data_page(struct f2fs_sb_info *, struct page *,
 	 struct f2fs_summary *, block_t, block_t);
 void rewrite_node_page(struct f2fs_sb_info *, struct page *,
 	 struct f2fs_summary *, block_t, block_t);
 void write_data_summaries(struct f2fs_sb_info *, block_t);
 void write_node_summaries(struct f2fs_sb_info *, block_t);
+void write_segmap_summary(struct f2fs_sb_info *, block_t);
 int lookup_journal_in_cursum(struct f2fs_summary_block *,
 	 int, unsigned int, int);
 void flush_sit_entries(struct f2fs_sb_info *);
+unsigned long long issue_discard_extents(struct f2fs_sb_info *, block_t,
+	 block_t, block_t, unsigned int);
+void flush_discard_extents(struct f2fs_sb_info *);
+int f2fs_trim_fs(struct f2fs_sb_info *, struct fstrim_range *);
+int get_ipu_policy(const char *);
+const char *ipu_policy_name(unsigned int);
 int build_segment_manager(struct f2fs_sb_info *);
 void reset_victim_segmap(struct f2fs_sb_info *);
 void destroy_segment_manager(struct f2fs_sb_info *);
+int create_segment_manager_caches(void);
+void destroy_segment_manager_caches(void);
 
 /**
  * checkpoint.c
@@ -938,18 +1137,27 @@ void destroy_checkpoint_caches(void);
  * data.c
  */
 int reserve_new_block(struct dnode_of_data *);
+void get_extent_info(struct inode *, struct f2fs_extent);
+void destroy_extent_tree(struct inode *);
 void update_extent_cache(block_t, struct dnode_of_data *);
 struct page *find_data_page(struct inode *, pgoff_t);
 struct page *get_lock_data_page(struct inode *, pgoff_t);
 struct page *get_new_data_page(struct inode *, pgoff_t, bool);
 int f2fs_readpage(struct f2fs_sb_info *, struct page *, block_t, int);
+struct bio *f2fs_read_merged(struct f2fs_sb_info *, struct bio *,
+	 struct page *, block_t, int);
 int do_write_data_page(struct page *);
+void init_extent_cache_info(struct f2fs_sb_info *);
+int create_extent_cache(void);
+void destroy_extent_cache(void);
 
 /**
  * gc.c
  */
 int start_gc_thread(struct f2fs_sb_info *);
 void stop_gc_thread(struct f2fs_sb_info *);
+int start_discard_thread(struct f2fs_sb_info *);
+void stop_discard_thread(struct f2fs_sb_info *);
 block_t start_bidx_of_node(unsigned int);
 int f2fs_gc(struct f2fs_sb_info *, int);
 #ifdef CONFIG_F2FS_STAT_FS
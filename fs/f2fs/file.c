@@ -17,6 +17,7 @@
 #include <linux/types.h>
 #include <linux/uaccess.h>
 #include <linux/mount.h>
+#include <linux/blkdev.h>
 
 #include "f2fs.h"
 #include "node.h"
@@ -129,7 +130,14 @@ int f2fs_sync_file(struct file *file, loff_t start, loff_t end, int datasync)
 	 .for_reclaim = 0,
 	};
 
+	/*
+	 * Let the IPU policy know the pages written back by this task for
+	 * the fsync range, not the ones of flushers running meanwhile.
+	 */
+	F2FS_I(inode)->fsync_task = current;
 	ret = filemap_write_and_wait_range(inode->i_mapping, start, end);
+	if (F2FS_I(inode)->fsync_task == current)
+	 F2FS_I(inode)->fsync_task = NULL;
 	if (ret)
 	 return ret;
 
@@ -567,6 +575,33 @@ static inline __u32 f2fs_mask_flags(umode_t mode, __u32 flags)
 	 return flags & F2FS_OTHER_FLMASK;
 }
 
+/**
+ * Caller should hold i_mutex.
+ * The inode page follows the new hint at once, while the other direct nodes
+ * get it from set_cold_node() when they are allocated.
+ */
+int f2fs_set_file_temp(struct inode *inode, unsigned int temp)
+{
+	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
+	struct page *node_page;
+
+	if (!S_ISREG(inode->i_mode))
+	 return -EINVAL;
+	if (temp > F2FS_TEMP_COLD)
+	 return -EINVAL;
+
+	node_page = get_node_page(sbi, inode->i_ino);
+	if (IS_ERR(node_page))
+	 return PTR_ERR(node_page);
+
+	wait_on_page_writeback(node_page);
+	set_file_temp(F2FS_I(inode), temp);
+	set_cold_node(inode, node_page);
+	update_inode(inode, node_page);
+	f2fs_put_page(node_page, 1);
+	return 0;
+}
+
 long f2fs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	struct inode *inode = filp->f_dentry->d_inode;
@@ -622,6 +657,58 @@ out:
 	 mnt_drop_write(filp->f_path.mnt);
 	 return ret;
 	}
+	case F2FS_IOC_GET_TEMPERATURE:
+	 flags = get_file_temp(fi);
+	 return put_user(flags, (__u32 __user *) arg);
+	case F2FS_IOC_SET_TEMPERATURE:
+	{
+	 ret = mnt_want_write(filp->f_path.mnt);
+	 if (ret)
+	 return ret;
+
+	 if (!inode_owner_or_capable(inode)) {
+	 ret = -EACCES;
+	 goto out_temp;
+	 }
+
+	 if (get_user(flags, (__u32 __user *) arg)) {
+	 ret = -EFAULT;
+	 goto out_temp;
+	 }
+
+	 mutex_lock(&inode->i_mutex);
+	 ret = f2fs_set_file_temp(inode, flags);
+	 mutex_unlock(&inode->i_mutex);
+out_temp:
+	 mnt_drop_write(filp->f_path.mnt);
+	 return ret;
+	}
+	case FITRIM:
+	{
+	 struct super_block *sb = inode->i_sb;
+	 struct request_queue *q = bdev_get_queue(sb->s_bdev);
+	 struct fstrim_range range;
+
+	 if (!capable(CAP_SYS_ADMIN))
+	 return -EPERM;
+	 if (!blk_queue_discard(q))
+	 return -EOPNOTSUPP;
+
+	 if (copy_from_user(&range, (struct fstrim_range __user *)arg,
+	 sizeof(range)))
+	 return -EFAULT;
+
+	 range.minlen = max((unsigned int)range.minlen,
+	 q->limits.discard_granularity);
+	 ret = f2fs_trim_fs(F2FS_SB(sb), &range);
+	 if (ret < 0)
+	 return ret;
+
+	 if (copy_to_user((struct fstrim_range __user *)arg, &range,
+	 sizeof(range)))
+	 return -EFAULT;
+	 return 0;
+	}
 	default:
 	 return -ENOTTY;
 	}
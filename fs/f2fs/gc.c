@@ -18,6 +18,9 @@
 #include <linux/delay.h>
 #include <linux/freezer.h>
 #include <linux/blkdev.h>
+#include <linux/uaccess.h>
+#include <linux/ioprio.h>
+#include <linux/math64.h>
 
 #include "f2fs.h"
 #include "node.h"
@@ -27,21 +30,55 @@
 static LIST_HEAD(f2fs_stat_list);
 static struct kmem_cache *winode_slab;
 
+/**
+ * Background GC should not write faster than gc_max_kbps on average.
+ * Returns how long the next round should be deferred in milliseconds.
+ * The data blocks moved by GC are counted when they are written back.
+ */
+static long gc_throttle_time(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_gc_kthread *gc_th = sbi->gc_thread;
+	unsigned int max_kbps = sbi->mount_opt.gc_max_kbps;
+	unsigned long long kbytes;
+	unsigned int elapsed_ms;
+	u64 need_ms;
+
+	if (!max_kbps)
+	 return 0;
+
+	kbytes = atomic64_read(&sbi->io_stat[F2FS_IO_GC].bytes) >> 10;
+	need_ms = div_u64((kbytes - gc_th->last_kbytes) * MSEC_PER_SEC,
+	 max_kbps);
+	elapsed_ms = jiffies_to_msecs(jiffies - gc_th->last_jiffies);
+	if (need_ms > elapsed_ms) {
+	 sbi->gc_throttled++;
+	 return need_ms - elapsed_ms;
+	}
+
+	gc_th->last_kbytes = kbytes;
+	gc_th->last_jiffies = jiffies;
+	return 0;
+}
+
 static int gc_thread_func(void *data)
 {
 	struct f2fs_sb_info *sbi = data;
 	wait_queue_head_t *wq = &sbi->gc_thread->gc_wait_queue_head;
-	long wait_ms;
+	long wait_ms, throttle_ms = 0;
 
 	wait_ms = GC_THREAD_MIN_SLEEP_TIME;
 
+	/* Background GC yields the disk to the other best-effort tasks */
+	set_task_ioprio(current,
+	 IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, IOPRIO_BE_NR - 1));
+
 	do {
 	 if (try_to_freeze())
 	 continue;
 	 else
 	 wait_event_interruptible_timeout(*wq,
 	 kthread_should_stop(),
-	 msecs_to_jiffies(wait_ms));
+	 msecs_to_jiffies(max(wait_ms, throttle_ms)));
 	 if (kthread_should_stop())
 	 break;
 
@@ -50,6 +87,10 @@ static int gc_thread_func(void *data)
 	 if (!test_opt(sbi, BG_GC))
 	 continue;
 
+	 throttle_ms = gc_throttle_time(sbi);
+	 if (throttle_ms)
+	 continue;
+
 	 /*
 	 * [GC triggering condition]
 	 * 0. GC is not conducted currently.
@@ -88,6 +129,63 @@ static int gc_thread_func(void *data)
 	return 0;
 }
 
+/**
+ * Pending discards are issued in small batches only while the device is
+ * idle, since discard commands can stall user IOs on many devices.
+ */
+static int discard_thread_func(void *data)
+{
+	struct f2fs_sb_info *sbi = data;
+	struct discard_info *dis_i = DISCARD_I(sbi);
+	wait_queue_head_t wq;
+	long wait_ms = DISCARD_THREAD_MAX_SLEEP_TIME;
+
+	init_waitqueue_head(&wq);
+	do {
+	 if (try_to_freeze())
+	 continue;
+	 else
+	 wait_event_interruptible_timeout(wq,
+	 kthread_should_stop(),
+	 msecs_to_jiffies(wait_ms));
+	 if (kthread_should_stop())
+	 break;
+
+	 if (!dis_i->nr_extents || !is_idle(sbi)) {
+	 wait_ms = DISCARD_THREAD_MAX_SLEEP_TIME;
+	 continue;
+	 }
+
+	 issue_discard_extents(sbi, 0, (block_t)~0, 1,
+	 DISCARD_ISSUE_BATCH);
+	 wait_ms = DISCARD_THREAD_MIN_SLEEP_TIME;
+	} while (!kthread_should_stop());
+	return 0;
+}
+
+int start_discard_thread(struct f2fs_sb_info *sbi)
+{
+	struct discard_info *dis_i = DISCARD_I(sbi);
+
+	dis_i->discard_task = kthread_run(discard_thread_func, sbi,
+	 DISCARD_THREAD_NAME);
+	if (IS_ERR(dis_i->discard_task)) {
+	 dis_i->discard_task = NULL;
+	 return -ENOMEM;
+	}
+	return 0;
+}
+
+void stop_discard_thread(struct f2fs_sb_info *sbi)
+{
+	struct discard_info *dis_i = DISCARD_I(sbi);
+
+	if (!dis_i->discard_task)
+	 return;
+	kthread_stop(dis_i->discard_task);
+	dis_i->discard_task = NULL;
+}
+
 int start_gc_thread(struct f2fs_sb_info *sbi)
 {
 	struct f2fs_gc_kthread *gc_th = NULL;
@@ -98,6 +196,8 @@ int start_gc_thread(struct f2fs_sb_info *sbi)
 
 	sbi->gc_thread = gc_th;
 	init_waitqueue_head(&sbi->gc_thread->gc_wait_queue_head);
+	gc_th->last_kbytes = atomic64_read(&sbi->io_stat[F2FS_IO_GC].bytes) >> 10;
+	gc_th->last_jiffies = jiffies;
 	sbi->gc_thread->f2fs_gc_task = kthread_run(gc_thread_func, sbi,
 	 GC_THREAD_NAME);
 	if (IS_ERR(gc_th->f2fs_gc_task)) {
@@ -176,28 +276,17 @@ static unsigned int check_bg_victims(struct f2fs_sb_info *sbi)
 static unsigned int get_cb_cost(struct f2fs_sb_info *sbi, unsigned int segno)
 {
 	struct sit_info *sit_i = SIT_I(sbi);
-	unsigned int secno = GET_SECNO(sbi, segno);
-	unsigned int start = secno << sbi->log_segs_per_sec;
-	unsigned long long mtime = 0;
+	unsigned long long mtime = get_sec_mtime(sbi, segno);
 	unsigned int vblocks;
 	unsigned char age = 0;
 	unsigned char u;
-	unsigned int i;
 
-	for (i = 0; i < sbi->segs_per_sec; i++)
-	 mtime += get_seg_entry(sbi, start + i)->mtime;
 	vblocks = get_valid_blocks(sbi, segno, sbi->log_segs_per_sec);
-
-	mtime >>= sbi->log_segs_per_sec;
 	vblocks >>= sbi->log_segs_per_sec;
 
 	u = (vblocks * 100) >> sbi->log_blocks_per_seg;
 
-	/* Handle if the system time is changed by user */
-	if (mtime < sit_i->min_mtime)
-	 sit_i->min_mtime = mtime;
-	if (mtime > sit_i->max_mtime)
-	 sit_i->max_mtime = mtime;
+	/* min and max are kept by update_sit_entry() */
 	if (sit_i->max_mtime != sit_i->min_mtime)
 	 age = 100 - div64_64(100 * (mtime - sit_i->min_mtime),
 	 sit_i->max_mtime - sit_i->min_mtime);
@@ -218,6 +307,61 @@ static unsigned int get_gc_cost(struct f2fs_sb_info *sbi, unsigned int segno,
 	 return get_cb_cost(sbi, segno);
 }
 
+/**
+ * Greedy selection takes the victim from the lowest non-empty bucket of the
+ * victim index, so that it does not depend on the number of dirty segments.
+ * A section bucket covers segs_per_sec costs, so a few entries are compared.
+ */
+static void get_victim_from_index(struct f2fs_sb_info *sbi, int gc_type,
+	 struct victim_sel_policy *p)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	unsigned int max_bucket = sbi->blocks_per_seg;
+	unsigned int bucket = 0;
+	struct victim_index *vi;
+	struct victim_entry *base;
+
+	if (p->alloc_mode == SSR) {
+	 vi = &dirty_i->ssr_index[p->type];
+	 base = dirty_i->seg_ventries;
+	} else {
+	 vi = &dirty_i->gc_index;
+	 base = dirty_i->sec_ventries;
+	}
+
+	/* fully valid entries are never selected */
+	while ((bucket = find_next_bit(vi->bucket_map, max_bucket, bucket))
+	 < max_bucket) {
+	 struct victim_entry *ve;
+	 int nsearched = 0;
+
+	 list_for_each_entry(ve, &vi->buckets[bucket], list) {
+	 unsigned int segno = (ve - base) << p->log_ofs_unit;
+	 unsigned long cost;
+
+	 if (test_bit(segno, dirty_i->victim_segmap[FG_GC]))
+	 continue;
+	 if (gc_type == BG_GC &&
+	 test_bit(segno, dirty_i->victim_segmap[BG_GC]))
+	 continue;
+	 if (IS_CURSEC(sbi, GET_SECNO(sbi, segno)))
+	 continue;
+
+	 cost = get_gc_cost(sbi, segno, p);
+	 if (p->min_cost > cost) {
+	 p->min_segno = segno;
+	 p->min_cost = cost;
+	 }
+	 if (cost == bucket << p->log_ofs_unit ||
+	 ++nsearched >= MAX_VICTIM_SEARCH)
+	 break;
+	 }
+	 if (p->min_segno != NULL_SEGNO)
+	 return;
+	 bucket++;
+	}
+}
+
 /**
  * This function is called from two pathes.
  * One is garbage collection and the other is SSR segment selection.
@@ -247,6 +391,11 @@ static int get_victim_by_default(struct f2fs_sb_info *sbi,
 	 goto got_it;
 	}
 
+	if (p.gc_mode == GC_GREEDY) {
+	 get_victim_from_index(sbi, gc_type, &p);
+	 goto got_it;
+	}
+
 	while (1) {
 	 unsigned long cost;
 
@@ -281,7 +430,7 @@ static int get_victim_by_default(struct f2fs_sb_info *sbi,
 	 if (cost == get_max_cost(sbi, &p))
 	 continue;
 
-	 if (nsearched++ >= MAX_VICTIM_SEARCH) {
+	 if (nsearched++ >= MAX_CB_VICTIM_SEARCH) {
 	 sbi->last_victim[p.gc_mode] = segno;
 	 break;
 	 }
@@ -374,6 +523,7 @@ static int gc_node_segment(struct f2fs_sb_info *sbi,
 {
 	bool initial = true;
 	struct f2fs_summary *entry;
+	struct node_ra_batch ra = { .nr = 0 };
 	int off;
 
 next_step:
@@ -401,7 +551,7 @@ next_step:
 	 continue;
 
 	 if (initial) {
-	 ra_node_page(sbi, nid);
+	 add_node_ra(sbi, &ra, nid);
 	 continue;
 	 }
 	 node_page = get_node_page(sbi, nid);
@@ -415,6 +565,7 @@ next_step:
 	 gc_stat_inc_node_blk_count(sbi, 1);
 	}
 	if (initial) {
+	 flush_node_ra(sbi, &ra);
 	 initial = false;
 	 goto next_step;
 	}
@@ -533,6 +684,7 @@ static int gc_data_segment(struct f2fs_sb_info *sbi, struct f2fs_summary *sum,
 {
 	struct super_block *sb = sbi->sb;
 	struct f2fs_summary *entry;
+	struct node_ra_batch ra = { .nr = 0 };
 	block_t start_addr;
 	int err, off;
 	int phase = 0;
@@ -567,7 +719,7 @@ next_step:
 	 continue;
 
 	 if (phase == 0) {
-	 ra_node_page(sbi, le32_to_cpu(entry->nid));
+	 add_node_ra(sbi, &ra, le32_to_cpu(entry->nid));
 	 continue;
 	 }
 
@@ -579,7 +731,7 @@ next_step:
 	 continue;
 
 	 if (phase == 1) {
-	 ra_node_page(sbi, dni.ino);
+	 add_node_ra(sbi, &ra, dni.ino);
 	 continue;
 	 }
 
@@ -601,11 +753,17 @@ next_step:
 	 } else {
 	 inode = find_gc_inode(dni.ino, ilist);
 	 if (inode) {
+	 /* Skip the blocks under direct I/O */
+	 if (!down_write_trylock(&F2FS_I(inode)->dio_rwsem))
+	 continue;
 	 data_page = get_lock_data_page(inode,
 	 start_bidx + ofs_in_node);
-	 if (IS_ERR(data_page))
+	 if (IS_ERR(data_page)) {
+	 up_write(&F2FS_I(inode)->dio_rwsem);
 	 continue;
+	 }
 	 move_data_page(inode, data_page, gc_type);
+	 up_write(&F2FS_I(inode)->dio_rwsem);
 	 gc_stat_inc_data_blk_count(sbi, 1);
 	 }
 	 }
@@ -613,6 +771,7 @@ next_step:
 next_iput:
 	 iput(inode);
 	}
+	flush_node_ra(sbi, &ra);
 	if (++phase < 4)
 	 goto next_step;
 	err = GC_DONE;
@@ -653,6 +812,9 @@ static int do_garbage_collect(struct f2fs_sb_info *sbi, unsigned int segno,
 	unlock_page(sum_page);
 	sum = page_address(sum_page);
 
+	/* valid blocks left in the victim show how well its log was chosen */
+	gc_stat_inc_victim(sbi, segno);
+
 	switch (GET_SUM_TYPE((&sum->footer))) {
 	case SUM_TYPE_NODE:
 	 ret = gc_node_segment(sbi, sum->entries, segno, gc_type);
@@ -677,6 +839,8 @@ int f2fs_gc(struct f2fs_sb_info *sbi, int nGC)
 	int gc_type = BG_GC;
 
 	INIT_LIST_HEAD(&ilist);
+	sbi->gc_task = current;
+	sbi->gc_fg = false;
 gc_more:
 	nfree = 0;
 	gc_status = GC_NONE;
@@ -688,8 +852,10 @@ gc_more:
 
 	while (sbi->sb->s_flags & MS_ACTIVE) {
 	 int i;
-	 if (has_not_enough_free_secs(sbi))
+	 if (has_not_enough_free_secs(sbi)) {
 	 gc_type = FG_GC;
+	 sbi->gc_fg = true;
+	 }
 
 	 cur_free_secs = free_sections(sbi) + nfree;
 
@@ -721,6 +887,7 @@ stop:
 	 goto gc_more;
 	}
 	sbi->last_gc_status = gc_status;
+	sbi->gc_task = NULL;
 	mutex_unlock(&sbi->gc_mutex);
 
 	put_gc_inode(&ilist);
@@ -729,6 +896,21 @@ stop:
 }
 
 #ifdef CONFIG_F2FS_STAT_FS
+static const char *io_class_names[NR_IO_CLASS] = {
+	[F2FS_IO_FG]	= "FG",
+	[F2FS_IO_GC]	= "GC",
+	[F2FS_IO_CP]	= "CP",
+};
+
+static const char *curseg_type_names[NR_CURSEG_TYPE] = {
+	[CURSEG_HOT_DATA]	= "HOT data",
+	[CURSEG_WARM_DATA]	= "WARM data",
+	[CURSEG_COLD_DATA]	= "COLD data",
+	[CURSEG_HOT_NODE]	= "Dir dnode",
+	[CURSEG_WARM_NODE]	= "File dnode",
+	[CURSEG_COLD_NODE]	= "Indir nodes",
+};
+
 void f2fs_update_stat(struct f2fs_sb_info *sbi)
 {
 	struct f2fs_gc_info *gc_i = sbi->gc_info;
@@ -736,8 +918,11 @@ void f2fs_update_stat(struct f2fs_sb_info *sbi)
 	int i;
 
 	/* valid check of the segment numbers */
-	si->hit_ext = sbi->read_hit_ext;
-	si->total_ext = sbi->total_hit_ext;
+	si->hit_ext = atomic_read(&sbi->read_hit_ext);
+	si->total_ext = atomic_read(&sbi->total_hit_ext);
+	si->ext_node = atomic_read(&sbi->total_ext_node);
+	si->evicted_ext = atomic_read(&sbi->evicted_ext);
+	si->lazy_ext = atomic_read(&sbi->lazy_ext);
 	si->ndirty_node = get_pages(sbi, F2FS_DIRTY_NODES);
 	si->ndirty_dent = get_pages(sbi, F2FS_DIRTY_DENTS);
 	si->ndirty_dirs = sbi->n_dirty_dirs;
@@ -760,6 +945,18 @@ void f2fs_update_stat(struct f2fs_sb_info *sbi)
 	si->sits = SIT_I(sbi)->dirty_sentries;
 	si->fnids = NM_I(sbi)->fcnt;
 	si->bg_gc = sbi->bg_gc;
+	si->discard_extents = DISCARD_I(sbi)->nr_extents;
+	si->discard_pending = DISCARD_I(sbi)->pending_blocks;
+	si->discard_queued = DISCARD_I(sbi)->queued_blocks;
+	si->discard_issued = DISCARD_I(sbi)->issued_blocks;
+	si->discard_cmds = DISCARD_I(sbi)->issued_cmds;
+	si->ipu_policy = sbi->mount_opt.ipu_policy;
+	for (i = 0; i < NR_IPU_POLICY; i++) {
+	 si->ipu_count[i] = atomic_read(&sbi->ipu_count[i]);
+	 si->opu_count[i] = atomic_read(&sbi->opu_count[i]);
+	}
+	for (i = 0; i < NR_CURSEG_DATA_TYPE; i++)
+	 si->temp_count[i] = atomic_read(&sbi->temp_count[i]);
 	si->util_free = (int)(free_user_blocks(sbi) >> sbi->log_blocks_per_seg)
 	 * 100 / (int)(sbi->user_block_count >> sbi->log_blocks_per_seg)
 	 / 2;
@@ -779,6 +976,28 @@ void f2fs_update_stat(struct f2fs_sb_info *sbi)
 	 si->segment_count[i] = sbi->segment_count[i];
 	 si->block_count[i] = sbi->block_count[i];
 	}
+	for (i = 0; i < NR_CURSEG_TYPE; i++) {
+	 si->log_segs[i] = sbi->log_segs[i];
+	 si->log_runs[i] = sbi->log_runs[i];
+	}
+	si->wb_deferred = atomic_read(&sbi->wb_deferred);
+	for (i = 0; i < NR_IO_CLASS; i++) {
+	 struct f2fs_io_stat *ios = &sbi->io_stat[i];
+
+	 si->io_bios[i] = atomic_read(&ios->bios);
+	 si->io_kbytes[i] = atomic64_read(&ios->bytes) >> 10;
+	 si->io_avg_lat[i] = si->io_bios[i] ?
+	 div_u64(atomic64_read(&ios->lat_us), si->io_bios[i]) : 0;
+	 si->io_max_lat[i] = ios->max_lat_us;
+	}
+	si->gc_max_kbps = sbi->mount_opt.gc_max_kbps;
+	si->gc_throttled = sbi->gc_throttled;
+	si->cp_count = sbi->cp_count;
+	si->cp_avg_us = sbi->cp_count ?
+	 div_u64(sbi->cp_total_us, sbi->cp_count) : 0;
+	si->cp_max_us = sbi->cp_max_us;
+	si->meta_written = sbi->meta_written;
+	si->meta_runs = sbi->meta_runs;
 }
 
 /**
@@ -823,6 +1042,7 @@ static int f2fs_read_gc(char *page, char **start, off_t off,
 	struct f2fs_gc_info *gc_i, *next;
 	struct f2fs_stat_info *si;
 	char *buf = page;
+	char *end = page + PAGE_SIZE;
 	int i = 0;
 
 	list_for_each_entry_safe(gc_i, next, &f2fs_stat_list, stat_list) {
@@ -836,91 +1056,157 @@ static int f2fs_read_gc(char *page, char **start, off_t off,
 	 }
 	 f2fs_update_stat(si->sbi);
 
-	 buf += sprintf(buf, "=====[ partition info. #%d ]=====\n", i++);
-	 buf += sprintf(buf, "[SB: 1] [CP: 2] [NAT: %d] [SIT: %d] ",
+	 buf += scnprintf(buf, end - buf,
+	 "=====[ partition info. #%d ]=====\n", i++);
+	 buf += scnprintf(buf, end - buf,
+	 "[SB: 1] [CP: 2] [NAT: %d] [SIT: %d] ",
 	 si->nat_area_segs, si->sit_area_segs);
-	 buf += sprintf(buf, "[SSA: %d] [MAIN: %d",
+	 buf += scnprintf(buf, end - buf, "[SSA: %d] [MAIN: %d",
 	 si->ssa_area_segs, si->main_area_segs);
-	 buf += sprintf(buf, "(OverProv:%d Resv:%d)]\n\n",
+	 buf += scnprintf(buf, end - buf, "(OverProv:%d Resv:%d)]\n\n",
 	 si->overp_segs, si->rsvd_segs);
-	 buf += sprintf(buf, "Utilization: %d%% (%d valid blocks)\n",
+	 buf += scnprintf(buf, end - buf,
+	 "Utilization: %d%% (%d valid blocks)\n",
 	 si->utilization, si->valid_count);
-	 buf += sprintf(buf, " - Node: %u (Inode: %u, ",
+	 buf += scnprintf(buf, end - buf, " - Node: %u (Inode: %u, ",
 	 si->valid_node_count, si->valid_inode_count);
-	 buf += sprintf(buf, "Other: %u)\n - Data: %u\n",
+	 buf += scnprintf(buf, end - buf, "Other: %u)\n - Data: %u\n",
 	 si->valid_node_count - si->valid_inode_count,
 	 si->valid_count - si->valid_node_count);
-	 buf += sprintf(buf, "\nMain area: %d segs, %d secs %d zones\n",
+	 buf += scnprintf(buf, end - buf,
+	 "\nMain area: %d segs, %d secs %d zones\n",
 	 si->main_area_segs, si->main_area_sections,
 	 si->main_area_zones);
-	 buf += sprintf(buf, " - COLD data: %d, %d, %d\n",
+	 buf += scnprintf(buf, end - buf, " - COLD data: %d, %d, %d\n",
 	 si->curseg[CURSEG_COLD_DATA],
 	 si->cursec[CURSEG_COLD_DATA],
 	 si->curzone[CURSEG_COLD_DATA]);
-	 buf += sprintf(buf, " - WARM data: %d, %d, %d\n",
+	 buf += scnprintf(buf, end - buf, " - WARM data: %d, %d, %d\n",
 	 si->curseg[CURSEG_WARM_DATA],
 	 si->cursec[CURSEG_WARM_DATA],
 	 si->curzone[CURSEG_WARM_DATA]);
-	 buf += sprintf(buf, " - HOT data: %d, %d, %d\n",
+	 buf += scnprintf(buf, end - buf, " - HOT data: %d, %d, %d\n",
 	 si->curseg[CURSEG_HOT_DATA],
 	 si->cursec[CURSEG_HOT_DATA],
 	 si->curzone[CURSEG_HOT_DATA]);
-	 buf += sprintf(buf, " - Dir dnode: %d, %d, %d\n",
+	 buf += scnprintf(buf, end - buf, " - Dir dnode: %d, %d, %d\n",
 	 si->curseg[CURSEG_HOT_NODE],
 	 si->cursec[CURSEG_HOT_NODE],
 	 si->curzone[CURSEG_HOT_NODE]);
-	 buf += sprintf(buf, " - File dnode: %d, %d, %d\n",
+	 buf += scnprintf(buf, end - buf, " - File dnode: %d, %d, %d\n",
 	 si->curseg[CURSEG_WARM_NODE],
 	 si->cursec[CURSEG_WARM_NODE],
 	 si->curzone[CURSEG_WARM_NODE]);
-	 buf += sprintf(buf, " - Indir nodes: %d, %d, %d\n",
+	 buf += scnprintf(buf, end - buf, " - Indir nodes: %d, %d, %d\n",
 	 si->curseg[CURSEG_COLD_NODE],
 	 si->cursec[CURSEG_COLD_NODE],
 	 si->curzone[CURSEG_COLD_NODE]);
-	 buf += sprintf(buf, "\n - Valid: %d\n - Dirty: %d\n",
+	 buf += scnprintf(buf, end - buf, "\n - Valid: %d\n - Dirty: %d\n",
 	 si->main_area_segs - si->dirty_count -
 	 si->prefree_count - si->free_segs,
 	 si->dirty_count);
-	 buf += sprintf(buf, " - Prefree: %d\n - Free: %d (%d)\n\n",
+	 buf += scnprintf(buf, end - buf,
+	 " - Prefree: %d\n - Free: %d (%d)\n\n",
 	 si->prefree_count,
 	 si->free_segs,
 	 si->free_secs);
-	 buf += sprintf(buf, "GC calls: %d (BG: %d)\n",
+	 buf += scnprintf(buf, end - buf, "GC calls: %d (BG: %d)\n",
 	 si->call_count, si->bg_gc);
-	 buf += sprintf(buf, " - data segments : %d\n", si->data_segs);
-	 buf += sprintf(buf, " - node segments : %d\n", si->node_segs);
-	 buf += sprintf(buf, "Try to move %d blocks\n", si->tot_blks);
-	 buf += sprintf(buf, " - data blocks : %d\n", si->data_blks);
-	 buf += sprintf(buf, " - node blocks : %d\n", si->node_blks);
-	 buf += sprintf(buf, "\nExtent Hit Ratio: %d / %d\n",
+	 buf += scnprintf(buf, end - buf,
+	 " - data segments : %d\n", si->data_segs);
+	 buf += scnprintf(buf, end - buf,
+	 " - node segments : %d\n", si->node_segs);
+	 buf += scnprintf(buf, end - buf,
+	 "Try to move %d blocks\n", si->tot_blks);
+	 buf += scnprintf(buf, end - buf,
+	 " - data blocks : %d\n", si->data_blks);
+	 buf += scnprintf(buf, end - buf,
+	 " - node blocks : %d\n", si->node_blks);
+	 buf += scnprintf(buf, end - buf,
+	 "GC victims: [ segs | valid blocks ]\n");
+	 for (j = 0; j < NR_CURSEG_TYPE; j++)
+	 buf += scnprintf(buf, end - buf, " - %-11s: %u | %llu\n",
+	 curseg_type_names[j],
+	 si->victim_segs[j],
+	 si->victim_vblocks[j]);
+	 buf += scnprintf(buf, end - buf, "Classified data blocks:\n");
+	 for (j = 0; j < NR_CURSEG_DATA_TYPE; j++)
+	 buf += scnprintf(buf, end - buf, " - %-11s: %u\n",
+	 curseg_type_names[j],
+	 si->temp_count[j]);
+	 buf += scnprintf(buf, end - buf,
+	 "Filled segments: [ segs | file runs ]\n");
+	 for (j = 0; j < NR_CURSEG_TYPE; j++)
+	 buf += scnprintf(buf, end - buf, " - %-11s: %u | %llu\n",
+	 curseg_type_names[j],
+	 si->log_segs[j],
+	 si->log_runs[j]);
+	 buf += scnprintf(buf, end - buf, "Deferred small files: %u\n",
+	 si->wb_deferred);
+	 buf += scnprintf(buf, end - buf, "\nExtent Hit Ratio: %d / %d\n",
 	 si->hit_ext, si->total_ext);
-	 buf += sprintf(buf, "\nBalancing F2FS Async:\n");
-	 buf += sprintf(buf, " - nodes %4d in %4d\n",
+	 buf += scnprintf(buf, end - buf, " - nodes: %d, evicted: %d\n",
+	 si->ext_node, si->evicted_ext);
+	 buf += scnprintf(buf, end - buf,
+	 " - inode page updates deferred: %d\n",
+	 si->lazy_ext);
+	 buf += scnprintf(buf, end - buf, "\nBalancing F2FS Async:\n");
+	 buf += scnprintf(buf, end - buf, " - nodes %4d in %4d\n",
 	 si->ndirty_node, si->node_pages);
-	 buf += sprintf(buf, " - dents %4d in dirs:%4d\n",
+	 buf += scnprintf(buf, end - buf, " - dents %4d in dirs:%4d\n",
 	 si->ndirty_dent, si->ndirty_dirs);
-	 buf += sprintf(buf, " - meta %4d in %4d\n",
+	 buf += scnprintf(buf, end - buf, " - meta %4d in %4d\n",
 	 si->ndirty_meta, si->meta_pages);
-	 buf += sprintf(buf, " - NATs %5d > %lu\n",
+	 buf += scnprintf(buf, end - buf, " - NATs %5d > %lu\n",
 	 si->nats, NM_WOUT_THRESHOLD);
-	 buf += sprintf(buf, " - SITs: %5d\n - free_nids: %5d\n",
+	 buf += scnprintf(buf, end - buf, " - SITs: %5d\n - free_nids: %5d\n",
 	 si->sits, si->fnids);
-	 buf += sprintf(buf, "\nDistribution of User Blocks:");
-	 buf += sprintf(buf, " [ valid | invalid | free ]\n");
-	 buf += sprintf(buf, " [");
+	 buf += scnprintf(buf, end - buf, "\nDistribution of User Blocks:");
+	 buf += scnprintf(buf, end - buf, " [ valid | invalid | free ]\n");
+	 buf += scnprintf(buf, end - buf, " [");
 	 for (j = 0; j < si->util_valid; j++)
-	 buf += sprintf(buf, "-");
-	 buf += sprintf(buf, "|");
+	 buf += scnprintf(buf, end - buf, "-");
+	 buf += scnprintf(buf, end - buf, "|");
 	 for (j = 0; j < si->util_invalid; j++)
-	 buf += sprintf(buf, "-");
-	 buf += sprintf(buf, "|");
+	 buf += scnprintf(buf, end - buf, "-");
+	 buf += scnprintf(buf, end - buf, "|");
 	 for (j = 0; j < si->util_free; j++)
-	 buf += sprintf(buf, "-");
-	 buf += sprintf(buf, "]\n\n");
-	 buf += sprintf(buf, "SSR: %u blocks in %u segments\n",
+	 buf += scnprintf(buf, end - buf, "-");
+	 buf += scnprintf(buf, end - buf, "]\n\n");
+	 buf += scnprintf(buf, end - buf, "SSR: %u blocks in %u segments\n",
 	 si->block_count[SSR], si->segment_count[SSR]);
-	 buf += sprintf(buf, "LFS: %u blocks in %u segments\n",
+	 buf += scnprintf(buf, end - buf, "LFS: %u blocks in %u segments\n",
 	 si->block_count[LFS], si->segment_count[LFS]);
+	 buf += scnprintf(buf, end - buf,
+	 "\nDiscard: %u blocks in %u extents\n",
+	 si->discard_pending, si->discard_extents);
+	 buf += scnprintf(buf, end - buf, " - queued : %llu blocks\n",
+	 si->discard_queued);
+	 buf += scnprintf(buf, end - buf,
+	 " - issued : %llu blocks in %llu cmds\n",
+	 si->discard_issued, si->discard_cmds);
+	 buf += scnprintf(buf, end - buf, "\nIPU policy: %s\n",
+	 ipu_policy_name(si->ipu_policy));
+	 for (j = 0; j < NR_IPU_POLICY; j++)
+	 buf += scnprintf(buf, end - buf, " - %-6s: IPU %u, OPU %u\n",
+	 ipu_policy_name(j),
+	 si->ipu_count[j], si->opu_count[j]);
+	 buf += scnprintf(buf, end - buf,
+	 "\nWrites: [ bios | KB | avg/max usecs ]\n");
+	 for (j = 0; j < NR_IO_CLASS; j++)
+	 buf += scnprintf(buf, end - buf, " - %s: %u | %llu | %llu/%u\n",
+	 io_class_names[j], si->io_bios[j],
+	 si->io_kbytes[j], si->io_avg_lat[j],
+	 si->io_max_lat[j]);
+	 buf += scnprintf(buf, end - buf,
+	 "BG GC cap: %u KB/s, throttled %u times\n",
+	 si->gc_max_kbps, si->gc_throttled);
+	 buf += scnprintf(buf, end - buf,
+	 "\nCheckpoint: %u, avg/max %llu/%u usecs\n",
+	 si->cp_count, si->cp_avg_us, si->cp_max_us);
+	 buf += scnprintf(buf, end - buf,
+	 " - meta : %llu blocks in %llu runs\n",
+	 si->meta_written, si->meta_runs);
 	 mutex_unlock(&si->stat_list);
 	}
 	return buf - page;
@@ -932,6 +1218,7 @@ static int f2fs_read_sit(char *page, char **start, off_t off,
 	struct f2fs_gc_info *gc_i, *next;
 	struct f2fs_stat_info *si;
 	char *buf = page;
+	char *end = page + PAGE_SIZE;
 
 	list_for_each_entry_safe(gc_i, next, &f2fs_stat_list, stat_list) {
 	 si = gc_i->stat_info;
@@ -943,19 +1230,55 @@ static int f2fs_read_sit(char *page, char **start, off_t off,
 	 }
 	 f2fs_update_gc_metric(si->sbi);
 
-	 buf += sprintf(buf, "BDF: %u, avg. vblocks: %u\n",
+	 buf += scnprintf(buf, end - buf, "BDF: %u, avg. vblocks: %u\n",
 	 si->bimodal, si->avg_vblocks);
 	 mutex_unlock(&si->stat_list);
 	}
 	return buf - page;
 }
 
+static int f2fs_read_mount(char *page, char **start, off_t off,
+	 int count, int *eof, void *data)
+{
+	struct f2fs_gc_info *gc_i, *next;
+	struct f2fs_stat_info *si;
+	char *buf = page;
+	char *end = page + PAGE_SIZE;
+
+	list_for_each_entry_safe(gc_i, next, &f2fs_stat_list, stat_list) {
+	 unsigned long long *t;
+
+	 si = gc_i->stat_info;
+	 mutex_lock(&si->stat_list);
+	 if (!si->sbi) {
+	 mutex_unlock(&si->stat_list);
+	 continue;
+	 }
+	 t = si->sbi->mount_time;
+	 buf += scnprintf(buf, end - buf,
+	 "Mount time: %llu us\n", t[MOUNT_TOTAL]);
+	 buf += scnprintf(buf, end - buf, "  - Checkpoint: %llu us\n",
+	 t[MOUNT_CHECKPOINT]);
+	 buf += scnprintf(buf, end - buf, "  - Segment manager: %llu us\n",
+	 t[MOUNT_SEGMENT_MANAGER]);
+	 buf += scnprintf(buf, end - buf, "    - SIT entries: %llu us\n",
+	 t[MOUNT_SIT_ENTRIES]);
+	 buf += scnprintf(buf, end - buf, "  - Node manager: %llu us\n",
+	 t[MOUNT_NODE_MANAGER]);
+	 buf += scnprintf(buf, end - buf, "  - Roll forward: %llu us\n",
+	 t[MOUNT_ROLL_FORWARD]);
+	 mutex_unlock(&si->stat_list);
+	}
+	return buf - page;
+}
+
 static int f2fs_read_mem(char *page, char **start, off_t off,
 	 int count, int *eof, void *data)
 {
 	struct f2fs_gc_info *gc_i, *next;
 	struct f2fs_stat_info *si;
 	char *buf = page;
+	char *end = page + PAGE_SIZE;
 
 	list_for_each_entry_safe(gc_i, next, &f2fs_stat_list, stat_list) {
 	 struct f2fs_sb_info *sbi = gc_i->stat_info->sbi;
@@ -989,19 +1312,30 @@ static int f2fs_read_mem(char *page, char **start, off_t off,
 	 base_mem += sizeof(struct free_segmap_info);
 	 base_mem += f2fs_bitmap_size(TOTAL_SEGS(sbi));
 	 base_mem += f2fs_bitmap_size(sbi->total_sections);
+	 base_mem += f2fs_bitmap_size(BITS_TO_LONGS(sbi->total_sections));
 
 	 /* build curseg */
-	 base_mem += sizeof(struct curseg_info) * DEFAULT_CURSEGS;
-	 base_mem += PAGE_CACHE_SIZE * DEFAULT_CURSEGS;
+	 base_mem += sizeof(struct curseg_info) * NR_CURSEGS(sbi);
+	 base_mem += PAGE_CACHE_SIZE * NR_CURSEGS(sbi);
 
 	 /* build dirty segmap */
 	 base_mem += sizeof(struct dirty_seglist_info);
 	 base_mem += NR_DIRTY_TYPE * f2fs_bitmap_size(TOTAL_SEGS(sbi));
 	 base_mem += 2 * f2fs_bitmap_size(TOTAL_SEGS(sbi));
 
+	 /* build victim index */
+	 base_mem += sizeof(struct victim_entry) *
+	 (TOTAL_SEGS(sbi) + sbi->total_sections);
+	 base_mem += (NR_CURSEG_TYPE + 1) * (NR_VICTIM_BUCKETS(sbi) *
+	 sizeof(struct list_head) +
+	 f2fs_bitmap_size(NR_VICTIM_BUCKETS(sbi)));
+
 	 /* buld nm */
 	 base_mem += sizeof(struct f2fs_nm_info);
 	 base_mem += __bitmap_size(sbi, NAT_BITMAP);
+	 base_mem += BITS_TO_LONGS(NM_I(sbi)->max_nid) *
+	 sizeof(unsigned long);
+	 base_mem += NM_I(sbi)->nat_blocks * sizeof(unsigned short);
 
 	 /* build gc */
 	 base_mem += sizeof(struct f2fs_gc_info);
@@ -1016,8 +1350,10 @@ static int f2fs_read_mem(char *page, char **start, off_t off,
 	 cache_mem += npages << PAGE_CACHE_SHIFT;
 	 cache_mem += sbi->n_orphans * sizeof(struct orphan_inode_entry);
 	 cache_mem += sbi->n_dirty_dirs * sizeof(struct dir_inode_entry);
+	 cache_mem += atomic_read(&sbi->total_ext_node) *
+	 sizeof(struct extent_node);
 
-	 buf += sprintf(buf, "%u KB = static: %u + cached: %u\n",
+	 buf += scnprintf(buf, end - buf, "%u KB = static: %u + cached: %u\n",
 	 (base_mem + cache_mem) >> 10,
 	 base_mem >> 10,
 	 cache_mem >> 10);
@@ -1026,6 +1362,161 @@ static int f2fs_read_mem(char *page, char **start, off_t off,
 	return buf - page;
 }
 
+static int f2fs_read_ipu_policy(char *page, char **start, off_t off,
+	 int count, int *eof, void *data)
+{
+	struct f2fs_sb_info *sbi = data;
+	return sprintf(page, "%s\n",
+	 ipu_policy_name(sbi->mount_opt.ipu_policy));
+}
+
+static int f2fs_write_ipu_policy(struct file *file, const char __user *buffer,
+	 unsigned long count, void *data)
+{
+	struct f2fs_sb_info *sbi = data;
+	char name[16];
+	int policy;
+
+	if (count >= sizeof(name))
+	 return -EINVAL;
+	if (copy_from_user(name, buffer, count))
+	 return -EFAULT;
+	name[count] = '\0';
+
+	policy = get_ipu_policy(strim(name));
+	if (policy < 0)
+	 return policy;
+	sbi->mount_opt.ipu_policy = policy;
+	return count;
+}
+
+static int f2fs_read_min_ipu_util(char *page, char **start, off_t off,
+	 int count, int *eof, void *data)
+{
+	struct f2fs_sb_info *sbi = data;
+	return sprintf(page, "%u\n", sbi->mount_opt.min_ipu_util);
+}
+
+static int f2fs_write_min_ipu_util(struct file *file,
+	 const char __user *buffer, unsigned long count, void *data)
+{
+	struct f2fs_sb_info *sbi = data;
+	unsigned int util;
+	int err;
+
+	err = kstrtouint_from_user(buffer, count, 10, &util);
+	if (err)
+	 return err;
+	if (util > 100)
+	 return -EINVAL;
+	sbi->mount_opt.min_ipu_util = util;
+	return count;
+}
+
+static int f2fs_read_gc_max_kbps(char *page, char **start, off_t off,
+	 int count, int *eof, void *data)
+{
+	struct f2fs_sb_info *sbi = data;
+	return sprintf(page, "%u\n", sbi->mount_opt.gc_max_kbps);
+}
+
+static int f2fs_write_gc_max_kbps(struct file *file,
+	 const char __user *buffer, unsigned long count, void *data)
+{
+	struct f2fs_sb_info *sbi = data;
+	unsigned int kbps;
+	int err;
+
+	err = kstrtouint_from_user(buffer, count, 10, &kbps);
+	if (err)
+	 return err;
+	sbi->mount_opt.gc_max_kbps = kbps;
+	return count;
+}
+
+static int f2fs_read_max_extents(char *page, char **start, off_t off,
+	 int count, int *eof, void *data)
+{
+	struct f2fs_sb_info *sbi = data;
+	return sprintf(page, "%u\n", sbi->mount_opt.max_extents);
+}
+
+static int f2fs_write_max_extents(struct file *file,
+	 const char __user *buffer, unsigned long count, void *data)
+{
+	struct f2fs_sb_info *sbi = data;
+	unsigned int max;
+	int err;
+
+	err = kstrtouint_from_user(buffer, count, 10, &max);
+	if (err)
+	 return err;
+	sbi->mount_opt.max_extents = max;
+	return count;
+}
+
+static int f2fs_read_bg_write_defer(char *page, char **start, off_t off,
+	 int count, int *eof, void *data)
+{
+	struct f2fs_sb_info *sbi = data;
+	return sprintf(page, "%u\n", sbi->mount_opt.bg_write_defer);
+}
+
+static int f2fs_write_bg_write_defer(struct file *file,
+	 const char __user *buffer, unsigned long count, void *data)
+{
+	struct f2fs_sb_info *sbi = data;
+	unsigned int msecs;
+	int err;
+
+	err = kstrtouint_from_user(buffer, count, 10, &msecs);
+	if (err)
+	 return err;
+	sbi->mount_opt.bg_write_defer = msecs;
+	return count;
+}
+
+static const struct {
+	const char *name;
+	read_proc_t *read_proc;
+	write_proc_t *write_proc;
+} f2fs_tunables[] = {
+	{ "f2fs_ipu_policy", f2fs_read_ipu_policy, f2fs_write_ipu_policy },
+	{ "f2fs_min_ipu_util", f2fs_read_min_ipu_util,
+	 f2fs_write_min_ipu_util },
+	{ "f2fs_gc_max_kbps", f2fs_read_gc_max_kbps,
+	 f2fs_write_gc_max_kbps },
+	{ "f2fs_max_extents", f2fs_read_max_extents,
+	 f2fs_write_max_extents },
+	{ "f2fs_bg_write_defer", f2fs_read_bg_write_defer,
+	 f2fs_write_bg_write_defer },
+};
+
+static void remove_tunables(struct f2fs_sb_info *sbi, int nr)
+{
+	while (nr--)
+	 remove_proc_entry(f2fs_tunables[nr].name, sbi->s_proc);
+}
+
+static int create_tunables(struct f2fs_sb_info *sbi)
+{
+	struct proc_dir_entry *entry;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(f2fs_tunables); i++) {
+	 entry = create_proc_entry(f2fs_tunables[i].name,
+	 S_IRUGO | S_IWUSR, sbi->s_proc);
+	 if (!entry) {
+	 remove_tunables(sbi, i);
+	 return -ENOMEM;
+	 }
+	 entry->read_proc = f2fs_tunables[i].read_proc;
+	 entry->write_proc = f2fs_tunables[i].write_proc;
+	 entry->data = sbi;
+	}
+	return 0;
+}
+
 int f2fs_stat_init(struct f2fs_sb_info *sbi)
 {
 	struct proc_dir_entry *entry;
@@ -1051,6 +1542,24 @@ int f2fs_stat_init(struct f2fs_sb_info *sbi)
 	}
 	entry->read_proc = f2fs_read_mem;
 	entry->write_proc = NULL;
+
+	entry = create_proc_entry("f2fs_mount_stat", 0, sbi->s_proc);
+	if (!entry) {
+	 remove_proc_entry("f2fs_mem_stat", sbi->s_proc);
+	 remove_proc_entry("f2fs_sit_stat", sbi->s_proc);
+	 remove_proc_entry("f2fs_stat", sbi->s_proc);
+	 return -ENOMEM;
+	}
+	entry->read_proc = f2fs_read_mount;
+	entry->write_proc = NULL;
+
+	if (create_tunables(sbi)) {
+	 remove_proc_entry("f2fs_mount_stat", sbi->s_proc);
+	 remove_proc_entry("f2fs_mem_stat", sbi->s_proc);
+	 remove_proc_entry("f2fs_sit_stat", sbi->s_proc);
+	 remove_proc_entry("f2fs_stat", sbi->s_proc);
+	 return -ENOMEM;
+	}
 	return 0;
 }
 
@@ -1060,6 +1569,8 @@ void f2fs_stat_exit(struct f2fs_sb_info *sbi)
 	 remove_proc_entry("f2fs_stat", sbi->s_proc);
 	 remove_proc_entry("f2fs_sit_stat", sbi->s_proc);
 	 remove_proc_entry("f2fs_mem_stat", sbi->s_proc);
+	 remove_proc_entry("f2fs_mount_stat", sbi->s_proc);
+	 remove_tunables(sbi, ARRAY_SIZE(f2fs_tunables));
 	}
 }
 #endif
@@ -17,11 +17,17 @@
 #define GC_THREAD_MIN_SLEEP_TIME	10000 /* milliseconds */
 #define GC_THREAD_MAX_SLEEP_TIME	30000
 #define GC_THREAD_NOGC_SLEEP_TIME	10000
+#define DISCARD_THREAD_NAME	"f2fs_discard"
+#define DISCARD_THREAD_MIN_SLEEP_TIME	50	/* milliseconds */
+#define DISCARD_THREAD_MAX_SLEEP_TIME	1000
+#define DISCARD_ISSUE_BATCH	8	/* # of discard commands at a time */
 #define LIMIT_INVALID_BLOCK	40 /* percentage over total user space */
 #define LIMIT_FREE_BLOCK	40 /* percentage over invalid + free space */
 
 /* Search max. number of dirty segments to select a victim segment */
 #define MAX_VICTIM_SEARCH	20
+/* Cost-benefit cost is cheap to get, so more sections can be compared */
+#define MAX_CB_VICTIM_SEARCH	256
 
 enum {
 	GC_NONE = 0,
@@ -43,7 +49,7 @@ struct f2fs_stat_info {
 	int main_area_segs;
 	int main_area_sections;
 	int main_area_zones;
-	int hit_ext, total_ext;
+	int hit_ext, total_ext, ext_node, evicted_ext, lazy_ext;
 	int ndirty_node;
 	int ndirty_dent;
 	int ndirty_dirs;
@@ -77,6 +83,30 @@ struct f2fs_stat_info {
 
 	unsigned int segment_count[2];
 	unsigned int block_count[2];
+
+	unsigned int discard_extents;
+	unsigned int discard_pending;
+	unsigned long long discard_queued;
+	unsigned long long discard_issued;
+	unsigned long long discard_cmds;
+
+	unsigned int ipu_policy;
+	unsigned int ipu_count[NR_IPU_POLICY];
+	unsigned int opu_count[NR_IPU_POLICY];
+
+	unsigned int temp_count[NR_CURSEG_DATA_TYPE];
+	unsigned int victim_segs[NR_CURSEG_TYPE];
+	unsigned long long victim_vblocks[NR_CURSEG_TYPE];
+	unsigned int log_segs[NR_CURSEG_TYPE];
+	unsigned long long log_runs[NR_CURSEG_TYPE];
+	unsigned int wb_deferred;
+	unsigned int io_bios[NR_IO_CLASS];
+	unsigned long long io_kbytes[NR_IO_CLASS];
+	unsigned long long io_avg_lat[NR_IO_CLASS];
+	unsigned int io_max_lat[NR_IO_CLASS];
+	unsigned int gc_max_kbps, gc_throttled;
+	unsigned int cp_count, cp_max_us;
+	unsigned long long cp_avg_us, meta_written, meta_runs;
 };
 
 #define GC_STAT_I(gi)	 ((gi)->stat_info)
@@ -93,6 +123,14 @@ struct f2fs_stat_info {
 	 GC_STAT_I(gi)->node_segs++;	 \
 	} while (0)
 
+#define gc_stat_inc_victim(sbi, segno)	 \
+	do {	 \
+	 struct f2fs_gc_info *gi = sbi->gc_info;	 \
+	 struct seg_entry *se = get_seg_entry(sbi, segno);	 \
+	 GC_STAT_I(gi)->victim_segs[se->type]++;	 \
+	 GC_STAT_I(gi)->victim_vblocks[se->type] += se->valid_blocks;	\
+	} while (0)
+
 #define gc_stat_inc_tot_blk_count(gi, blks)	 \
 	((GC_STAT_I(gi)->tot_blks) += (blks))
 
@@ -113,6 +151,7 @@ struct f2fs_stat_info {
 #else
 #define gc_stat_inc_call_count(gi)
 #define gc_stat_inc_seg_count(gi, type)
+#define gc_stat_inc_victim(sbi, segno)
 #define gc_stat_inc_tot_blk_count(gi, blks)
 #define gc_stat_inc_data_blk_count(gi, blks)
 #define gc_stat_inc_node_blk_count(sbi, blks)
@@ -121,6 +160,8 @@ struct f2fs_stat_info {
 struct f2fs_gc_kthread {
 	struct task_struct *f2fs_gc_task;
 	wait_queue_head_t gc_wait_queue_head;
+	unsigned long long last_kbytes;	/* GC writes in KB at the last round */
+	unsigned long last_jiffies;	/* time of the last round */
 };
 
 struct inode_entry {
@@ -102,9 +102,10 @@ static int do_read_inode(struct inode *inode)
 	fi->current_depth = le32_to_cpu(ri->current_depth);
 	fi->i_xattr_nid = le32_to_cpu(ri->i_xattr_nid);
 	fi->i_flags = le32_to_cpu(ri->i_flags);
+	fi->i_advise = ri->i_advise;
 	fi->flags = 0;
 	fi->data_version = le64_to_cpu(F2FS_CKPT(sbi)->checkpoint_ver) - 1;
-	get_extent_info(&fi->ext, ri->i_ext);
+	get_extent_info(inode, ri->i_ext);
 	f2fs_put_page(node_page, 1);
 	return 0;
 }
@@ -193,6 +194,7 @@ void update_inode(struct inode *inode, struct page *node_page)
 	ri->current_depth = cpu_to_le32(F2FS_I(inode)->current_depth);
 	ri->i_xattr_nid = cpu_to_le32(F2FS_I(inode)->i_xattr_nid);
 	ri->i_flags = cpu_to_le32(F2FS_I(inode)->i_flags);
+	ri->i_advise = F2FS_I(inode)->i_advise;
 	set_page_dirty(node_page);
 }
 
@@ -254,5 +256,6 @@ void f2fs_evict_inode(struct inode *inode)
 
 	remove_inode_page(inode);
 no_delete:
+	destroy_extent_tree(inode);
 	clear_inode(inode);
 }
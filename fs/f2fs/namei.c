@@ -133,7 +133,7 @@ static inline void set_cold_file(struct inode *inode, const unsigned char *name)
 
 	while (*extlist) {
 	 if (!is_multimedia_file(name, *extlist)) {
-	 F2FS_I(inode)->is_cold = 1;
+	 set_file_temp(F2FS_I(inode), F2FS_TEMP_COLD);
 	 break;
 	 }
 	 extlist++;
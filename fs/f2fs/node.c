@@ -15,6 +15,8 @@
 #include <linux/blkdev.h>
 #include <linux/pagevec.h>
 #include <linux/swap.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
 
 #include "f2fs.h"
 #include "node.h"
@@ -134,6 +136,25 @@ static void __del_from_nat_cache(struct f2fs_nm_info *nm_i, struct nat_entry *e)
 	kmem_cache_free(nat_entry_slab, e);
 }
 
+/**
+ * Keep the free nid bitmap and the free count of the NAT block in step.
+ * Updates are serialized by nat_tree_lock, while build_free_nids() reads
+ * the bitmap without it and relies on its nat cache cross-check.
+ */
+static void __update_free_nid_bitmap(struct f2fs_nm_info *nm_i,
+	 nid_t nid, bool free)
+{
+	unsigned int nat_ofs = NAT_BLOCK_OFFSET(nid);
+
+	if (free) {
+	 if (!__test_and_set_bit(nid, nm_i->free_nid_bitmap))
+	 nm_i->free_nid_count[nat_ofs]++;
+	} else {
+	 if (__test_and_clear_bit(nid, nm_i->free_nid_bitmap))
+	 nm_i->free_nid_count[nat_ofs]--;
+	}
+}
+
 int is_checkpointed_node(struct f2fs_sb_info *sbi, nid_t nid)
 {
 	struct f2fs_nm_info *nm_i = NM_I(sbi);
@@ -221,6 +242,10 @@ static void set_node_addr(struct f2fs_sb_info *sbi, struct node_info *ni,
 	/* change address */
 	nat_set_blkaddr(e, new_blkaddr);
 	__set_nat_cache_dirty(nm_i, e);
+
+	/* a freed nid becomes free again only after checkpoint */
+	if (new_blkaddr != NULL_ADDR)
+	 __update_free_nid_bitmap(nm_i, ni->nid, false);
 	write_unlock(&nm_i->nat_tree_lock);
 }
 
@@ -468,6 +493,122 @@ release_out:
 	return err;
 }
 
+struct node_ra {
+	nid_t nid;
+	block_t blk_addr;
+	struct page *page;
+};
+
+static int cmp_ra_nid(const void *a, const void *b)
+{
+	const struct node_ra *ra = a, *rb = b;
+
+	if (ra->nid == rb->nid)
+	 return 0;
+	return ra->nid < rb->nid ? -1 : 1;
+}
+
+static int cmp_ra_blkaddr(const void *a, const void *b)
+{
+	const struct node_ra *ra = a, *rb = b;
+
+	if (ra->blk_addr == rb->blk_addr)
+	 return 0;
+	return ra->blk_addr < rb->blk_addr ? -1 : 1;
+}
+
+/**
+ * Readahead a set of node pages at once.
+ * The nids are resolved in their order, so that each NAT block is visited
+ * once, and the node blocks are read in the order of their addresses with
+ * merged bios. The pages cached already or being read are skipped.
+ */
+void ra_node_pages(struct f2fs_sb_info *sbi, nid_t *nids, int nr)
+{
+	struct address_space *mapping = sbi->node_inode->i_mapping;
+	struct blk_plug plug;
+	struct bio *bio = NULL;
+	struct node_info ni;
+	struct node_ra *ra;
+	int i, cnt = 0;
+
+	if (nr <= 0)
+	 return;
+
+	ra = kmalloc(nr * sizeof(struct node_ra), GFP_NOFS);
+	if (!ra) {
+	 for (i = 0; i < nr; i++)
+	 ra_node_page(sbi, nids[i]);
+	 return;
+	}
+	for (i = 0; i < nr; i++)
+	 ra[i].nid = nids[i];
+	sort(ra, nr, sizeof(struct node_ra), cmp_ra_nid, NULL);
+
+	for (i = 0; i < nr; i++) {
+	 nid_t nid = ra[i].nid;
+	 struct page *page;
+
+	 if (!nid || (i && ra[i - 1].nid == nid))
+	 continue;
+
+	 page = find_get_page(mapping, nid);
+	 if (page) {
+	 page_cache_release(page);
+	 continue;
+	 }
+
+	 /* new pages are locked by us only, so no one can wait for us */
+	 page = page_cache_alloc_cold(mapping);
+	 if (!page)
+	 break;
+	 if (add_to_page_cache_lru(page, mapping, nid, GFP_NOFS)) {
+	 page_cache_release(page);
+	 continue;
+	 }
+
+	 get_node_info(sbi, nid, &ni);
+	 if (ni.blk_addr == NULL_ADDR) {
+	 unlock_page(page);
+	 page_cache_release(page);
+	 continue;
+	 }
+	 ra[cnt].nid = nid;
+	 ra[cnt].blk_addr = ni.blk_addr;
+	 ra[cnt].page = page;
+	 cnt++;
+	}
+	sort(ra, cnt, sizeof(struct node_ra), cmp_ra_blkaddr, NULL);
+
+	blk_start_plug(&plug);
+	for (i = 0; i < cnt; i++) {
+	 bio = f2fs_read_merged(sbi, bio, ra[i].page, ra[i].blk_addr, READ);
+	 page_cache_release(ra[i].page);
+	}
+	if (bio)
+	 submit_bio(READ, bio);
+	blk_finish_plug(&plug);
+	kfree(ra);
+}
+
+/**
+ * Readahead the child nodes of an indirect node in [start, end)
+ */
+static void ra_child_nodes(struct f2fs_sb_info *sbi, struct page *parent,
+	 int start, int end)
+{
+	struct node_ra_batch ra = { .nr = 0 };
+	nid_t nid;
+
+	end = min(end, NIDS_PER_BLOCK);
+	for (; start < end; start++) {
+	 nid = get_nid(parent, start, false);
+	 if (nid)
+	 add_node_ra(sbi, &ra, nid);
+	}
+	flush_node_ra(sbi, &ra);
+}
+
 static void truncate_node(struct dnode_of_data *dn)
 {
 	struct f2fs_sb_info *sbi = F2FS_SB(dn->inode->i_sb);
@@ -542,6 +683,8 @@ static int truncate_nodes(struct dnode_of_data *dn, unsigned int nofs,
 	rn = (struct f2fs_node *)page_address(page);
 	if (depth < 3) {
 	 for (i = ofs; i < NIDS_PER_BLOCK; i++, freed++) {
+	 if ((i - ofs) % MAX_RA_NODE == 0)
+	 ra_child_nodes(sbi, page, i, i + MAX_RA_NODE);
 	 child_nid = le32_to_cpu(rn->in.nid[i]);
 	 if (child_nid == 0)
 	 continue;
@@ -554,6 +697,8 @@ static int truncate_nodes(struct dnode_of_data *dn, unsigned int nofs,
 	} else {
 	 child_nofs = nofs + ofs * (NIDS_PER_BLOCK + 1) + 1;
 	 for (i = ofs; i < NIDS_PER_BLOCK; i++) {
+	 if ((i - ofs) % MAX_RA_NODE == 0)
+	 ra_child_nodes(sbi, page, i, i + MAX_RA_NODE);
 	 child_nid = le32_to_cpu(rn->in.nid[i]);
 	 if (child_nid == 0) {
 	 child_nofs += NIDS_PER_BLOCK + 1;
@@ -615,6 +760,8 @@ static int truncate_partial_nodes(struct dnode_of_data *dn,
 
 	/* free direct nodes linked to a partial indirect node */
 	for (i = offset[depth - 1]; i < NIDS_PER_BLOCK; i++) {
+	 if ((i - offset[depth - 1]) % MAX_RA_NODE == 0)
+	 ra_child_nodes(sbi, pages[idx], i, i + MAX_RA_NODE);
 	 child_nid = get_nid(pages[idx], i, false);
 	 if (!child_nid)
 	 continue;
@@ -903,14 +1050,12 @@ struct page *get_node_page(struct f2fs_sb_info *sbi, pgoff_t nid)
 
 /**
  * Return a locked page for the desired node page.
- * And, readahead MAX_RA_NODE number of node pages.
+ * And, readahead MAX_RA_NODE number of node pages together.
  */
 struct page *get_node_page_ra(struct page *parent, int start)
 {
 	struct f2fs_sb_info *sbi = F2FS_SB(parent->mapping->host->i_sb);
 	struct address_space *mapping = sbi->node_inode->i_mapping;
-	int i, end;
-	int err = 0;
 	nid_t nid;
 	struct page *page;
 
@@ -924,26 +1069,9 @@ struct page *get_node_page_ra(struct page *parent, int start)
 	 goto page_hit;
 	f2fs_put_page(page, 0);
 
-repeat:
-	page = grab_cache_page(mapping, nid);
-	if (!page)
-	 return ERR_PTR(-ENOMEM);
-
-	err = read_node_page(page, READA);
-	if (err) {
-	 f2fs_put_page(page, 1);
-	 return ERR_PTR(err);
-	}
-
-	/* Then, try readahead for siblings of the desired node */
-	end = start + MAX_RA_NODE;
-	end = min(end, NIDS_PER_BLOCK);
-	for (i = start + 1; i < end; i++) {
-	 nid = get_nid(parent, i, false);
-	 if (!nid)
-	 continue;
-	 ra_node_page(sbi, nid);
-	}
+	/* Then, read the desired node along with its siblings */
+	ra_child_nodes(sbi, parent, start, start + MAX_RA_NODE);
+	return get_node_page(sbi, nid);
 
 page_hit:
 	lock_page(page);
@@ -955,7 +1083,7 @@ page_hit:
 	/* Has the page been truncated? */
 	if (page->mapping != mapping) {
 	 f2fs_put_page(page, 1);
-	 goto repeat;
+	 return get_node_page(sbi, nid);
 	}
 	return page;
 }
@@ -981,10 +1109,12 @@ int sync_node_pages(struct f2fs_sb_info *sbi, nid_t ino,
 	struct address_space *mapping = sbi->node_inode->i_mapping;
 	pgoff_t index, end;
 	struct pagevec pvec;
+	struct blk_plug plug;
 	int step = ino ? 2 : 0;
 	int nwritten = 0, wrote = 0;
 
 	pagevec_init(&pvec, 0);
+	blk_start_plug(&plug);
 
 next_step:
 	index = 0;
@@ -1004,8 +1134,9 @@ next_step:
 	 /*
 	 * flushing sequence with step:
 	 * 0. indirect nodes
-	 * 1. dentry dnodes
+	 * 1. dentry dnodes and dnodes of hot files
 	 * 2. file dnodes
+	 * fsync() takes every dnode of its file in step 2.
 	 */
 	 if (step == 0 && IS_DNODE(page))
 	 continue;
@@ -1013,7 +1144,7 @@ next_step:
 	 is_cold_node(page)))
 	 continue;
 	 if (step == 2 && (!IS_DNODE(page) ||
-	 !is_cold_node(page)))
+	 (!ino && !is_cold_node(page))))
 	 continue;
 
 	 /*
@@ -1074,6 +1205,7 @@ continue_unlock:
 
 	if (wrote)
 	 f2fs_submit_bio(sbi, NODE, wbc->sync_mode == WB_SYNC_ALL);
+	blk_finish_plug(&plug);
 
 	return nwritten;
 }
@@ -1188,22 +1320,17 @@ const struct address_space_operations f2fs_node_aops = {
 	.releasepage	= f2fs_release_node_page,
 };
 
-static struct free_nid *__lookup_free_nid_list(nid_t n, struct list_head *head)
+static struct free_nid *__lookup_free_nid_list(struct f2fs_nm_info *nm_i,
+	 nid_t n)
 {
-	struct list_head *this;
-	struct free_nid *i = NULL;
-	list_for_each(this, head) {
-	 i = list_entry(this, struct free_nid, list);
-	 if (i->nid == n)
-	 break;
-	 i = NULL;
-	}
-	return i;
+	return radix_tree_lookup(&nm_i->free_nid_root, n);
 }
 
-static void __del_from_free_nid_list(struct free_nid *i)
+static void __del_from_free_nid_list(struct f2fs_nm_info *nm_i,
+	 struct free_nid *i)
 {
 	list_del(&i->list);
+	radix_tree_delete(&nm_i->free_nid_root, i->nid);
 	kmem_cache_free(free_nid_slab, i);
 }
 
@@ -1222,15 +1349,23 @@ retry:
 	i->nid = nid;
 	i->state = NID_NEW;
 
+	if (radix_tree_preload(GFP_NOFS)) {
+	 kmem_cache_free(free_nid_slab, i);
+	 cond_resched();
+	 goto retry;
+	}
+
 	spin_lock(&nm_i->free_nid_list_lock);
-	if (__lookup_free_nid_list(nid, &nm_i->free_nid_list)) {
+	if (radix_tree_insert(&nm_i->free_nid_root, nid, i)) {
 	 spin_unlock(&nm_i->free_nid_list_lock);
+	 radix_tree_preload_end();
 	 kmem_cache_free(free_nid_slab, i);
 	 return 0;
 	}
 	list_add_tail(&i->list, &nm_i->free_nid_list);
 	nm_i->fcnt++;
 	spin_unlock(&nm_i->free_nid_list_lock);
+	radix_tree_preload_end();
 	return 1;
 }
 
@@ -1238,20 +1373,19 @@ static void remove_free_nid(struct f2fs_nm_info *nm_i, nid_t nid)
 {
 	struct free_nid *i;
 	spin_lock(&nm_i->free_nid_list_lock);
-	i = __lookup_free_nid_list(nid, &nm_i->free_nid_list);
+	i = __lookup_free_nid_list(nm_i, nid);
 	if (i && i->state == NID_NEW) {
-	 __del_from_free_nid_list(i);
+	 __del_from_free_nid_list(nm_i, i);
 	 nm_i->fcnt--;
 	}
 	spin_unlock(&nm_i->free_nid_list_lock);
 }
 
-static int scan_nat_page(struct f2fs_nm_info *nm_i,
+static void scan_nat_page(struct f2fs_nm_info *nm_i,
 	 struct page *nat_page, nid_t start_nid)
 {
 	struct f2fs_nat_block *nat_blk = page_address(nat_page);
 	block_t blk_addr;
-	int fcnt = 0;
 	int i;
 
 	/* 0 nid should not be used */
@@ -1264,7 +1398,55 @@ static int scan_nat_page(struct f2fs_nm_info *nm_i,
 	 blk_addr = le32_to_cpu(nat_blk->entries[i].block_addr);
 	 BUG_ON(blk_addr == NEW_ADDR);
 	 if (blk_addr == NULL_ADDR)
-	 fcnt += add_free_nid(nm_i, start_nid);
+	 __update_free_nid_bitmap(nm_i, start_nid, true);
+	}
+}
+
+/**
+ * Read every NAT block once at mount time, and apply the NAT journal on top,
+ * so that later free nid scans never have to read NAT pages.
+ */
+static void build_free_nid_bitmap(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_nm_info *nm_i = NM_I(sbi);
+	struct curseg_info *curseg = CURSEG_I(sbi, CURSEG_HOT_DATA);
+	struct f2fs_summary_block *sum = curseg->sum_blk;
+	nid_t nid;
+	int i;
+
+	for (nid = 0; nid < nm_i->max_nid; nid += NAT_ENTRY_PER_BLOCK) {
+	 struct page *page;
+
+	 if (NAT_BLOCK_OFFSET(nid) % FREE_NID_PAGES == 0)
+	 ra_nat_pages(sbi, nid);
+
+	 page = get_current_nat_page(sbi, nid);
+	 scan_nat_page(nm_i, page, nid);
+	 f2fs_put_page(page, 1);
+	}
+
+	mutex_lock(&curseg->curseg_mutex);
+	for (i = 0; i < nats_in_cursum(sum); i++) {
+	 block_t addr = le32_to_cpu(nat_in_journal(sum, i).block_addr);
+	 nid = le32_to_cpu(nid_in_journal(sum, i));
+	 __update_free_nid_bitmap(nm_i, nid, addr == NULL_ADDR);
+	}
+	mutex_unlock(&curseg->curseg_mutex);
+}
+
+static int scan_free_nid_bits(struct f2fs_nm_info *nm_i, nid_t start_nid)
+{
+	nid_t end_nid = START_NID(start_nid) + NAT_ENTRY_PER_BLOCK;
+	int fcnt = 0;
+	nid_t nid;
+
+	if (!nm_i->free_nid_count[NAT_BLOCK_OFFSET(start_nid)])
+	 return 0;
+
+	nid = find_next_bit(nm_i->free_nid_bitmap, end_nid, start_nid);
+	while (nid < end_nid) {
+	 fcnt += add_free_nid(nm_i, nid);
+	 nid = find_next_bit(nm_i->free_nid_bitmap, end_nid, nid + 1);
 	}
 	return fcnt;
 }
@@ -1283,13 +1465,8 @@ static void build_free_nids(struct f2fs_sb_info *sbi)
 	nid = get_next_scan_nid(nm_i);
 	nm_i->init_scan_nid = nid;
 
-	ra_nat_pages(sbi, nid);
-
 	while (1) {
-	 struct page *page = get_current_nat_page(sbi, nid);
-
-	 fcnt += scan_nat_page(nm_i, page, nid);
-	 f2fs_put_page(page, 1);
+	 fcnt += scan_free_nid_bits(nm_i, nid);
 
 	 nid += (NAT_ENTRY_PER_BLOCK - (nid % NAT_ENTRY_PER_BLOCK));
 
@@ -1318,15 +1495,19 @@ static void build_free_nids(struct f2fs_sb_info *sbi)
 	mutex_unlock(&curseg->curseg_mutex);
 
 	/* remove the free nids from current allocated nids */
+	read_lock(&nm_i->nat_tree_lock);
+	spin_lock(&nm_i->free_nid_list_lock);
 	list_for_each_entry_safe(fnid, next_fnid, &nm_i->free_nid_list, list) {
 	 struct nat_entry *ne;
 
-	 read_lock(&nm_i->nat_tree_lock);
 	 ne = __lookup_nat_cache(nm_i, fnid->nid);
-	 if (ne && nat_get_blkaddr(ne) != NULL_ADDR)
-	 remove_free_nid(nm_i, fnid->nid);
-	 read_unlock(&nm_i->nat_tree_lock);
+	 if (ne && nat_get_blkaddr(ne) != NULL_ADDR) {
+	 __del_from_free_nid_list(nm_i, fnid);
+	 nm_i->fcnt--;
+	 }
 	}
+	spin_unlock(&nm_i->free_nid_list_lock);
+	read_unlock(&nm_i->nat_tree_lock);
 }
 
 /*
@@ -1337,8 +1518,7 @@ static void build_free_nids(struct f2fs_sb_info *sbi)
 bool alloc_nid(struct f2fs_sb_info *sbi, nid_t *nid)
 {
 	struct f2fs_nm_info *nm_i = NM_I(sbi);
-	struct free_nid *i = NULL;
-	struct list_head *this;
+	struct free_nid *i;
 retry:
 	mutex_lock(&nm_i->build_lock);
 	if (!nm_i->fcnt) {
@@ -1363,15 +1543,11 @@ retry:
 	}
 
 	BUG_ON(list_empty(&nm_i->free_nid_list));
-	list_for_each(this, &nm_i->free_nid_list) {
-	 i = list_entry(this, struct free_nid, list);
-	 if (i->state == NID_NEW)
-	 break;
-	}
-
+	i = list_first_entry(&nm_i->free_nid_list, struct free_nid, list);
 	BUG_ON(i->state != NID_NEW);
 	*nid = i->nid;
 	i->state = NID_ALLOC;
+	list_move_tail(&i->list, &nm_i->alloc_nid_list);
 	nm_i->fcnt--;
 	spin_unlock(&nm_i->free_nid_list_lock);
 	return true;
@@ -1386,21 +1562,30 @@ void alloc_nid_done(struct f2fs_sb_info *sbi, nid_t nid)
 	struct free_nid *i;
 
 	spin_lock(&nm_i->free_nid_list_lock);
-	i = __lookup_free_nid_list(nid, &nm_i->free_nid_list);
+	i = __lookup_free_nid_list(nm_i, nid);
 	if (i) {
 	 BUG_ON(i->state != NID_ALLOC);
-	 __del_from_free_nid_list(i);
+	 __del_from_free_nid_list(nm_i, i);
 	}
 	spin_unlock(&nm_i->free_nid_list_lock);
 }
 
 /**
  * alloc_nid() should be called prior to this function.
+ * The nid goes back to the free list without another slab allocation.
  */
 void alloc_nid_failed(struct f2fs_sb_info *sbi, nid_t nid)
 {
-	alloc_nid_done(sbi, nid);
-	add_free_nid(NM_I(sbi), nid);
+	struct f2fs_nm_info *nm_i = NM_I(sbi);
+	struct free_nid *i;
+
+	spin_lock(&nm_i->free_nid_list_lock);
+	i = __lookup_free_nid_list(nm_i, nid);
+	BUG_ON(!i || i->state != NID_ALLOC);
+	i->state = NID_NEW;
+	list_move_tail(&i->list, &nm_i->free_nid_list);
+	nm_i->fcnt++;
+	spin_unlock(&nm_i->free_nid_list_lock);
 }
 
 void recover_node_page(struct f2fs_sb_info *sbi, struct page *page,
@@ -1615,6 +1800,7 @@ flush_now:
 	 if (nat_get_blkaddr(ne) == NULL_ADDR) {
 	 write_lock(&nm_i->nat_tree_lock);
 	 __del_from_nat_cache(nm_i, ne);
+	 __update_free_nid_bitmap(nm_i, nid, true);
 	 write_unlock(&nm_i->nat_tree_lock);
 
 	 /* We can reuse this freed nid at this point */
@@ -1623,6 +1809,7 @@ flush_now:
 	 write_lock(&nm_i->nat_tree_lock);
 	 __clear_nat_cache_dirty(nm_i, ne);
 	 ne->checkpointed = true;
+	 __update_free_nid_bitmap(nm_i, nid, false);
 	 write_unlock(&nm_i->nat_tree_lock);
 	 }
 	}
@@ -1660,6 +1847,8 @@ static int init_node_manager(struct f2fs_sb_info *sbi)
 	nm_i->nat_cnt = 0;
 
 	INIT_LIST_HEAD(&nm_i->free_nid_list);
+	INIT_LIST_HEAD(&nm_i->alloc_nid_list);
+	INIT_RADIX_TREE(&nm_i->free_nid_root, GFP_ATOMIC);
 	INIT_RADIX_TREE(&nm_i->nat_root, __GFP_HIGH | __GFP_NOFAIL);
 	INIT_LIST_HEAD(&nm_i->nat_entries);
 	INIT_LIST_HEAD(&nm_i->dirty_nat_entries);
@@ -1694,6 +1883,15 @@ static int init_node_manager(struct f2fs_sb_info *sbi)
 
 	/* copy version bitmap */
 	memcpy(nm_i->nat_bitmap, version_bitmap, nm_i->bitmap_size);
+
+	nm_i->free_nid_bitmap = vzalloc(BITS_TO_LONGS(nm_i->max_nid) *
+	 sizeof(unsigned long));
+	if (!nm_i->free_nid_bitmap)
+	 return -ENOMEM;
+	nm_i->free_nid_count = vzalloc(nm_i->nat_blocks *
+	 sizeof(unsigned short));
+	if (!nm_i->free_nid_count)
+	 return -ENOMEM;
 	return 0;
 }
 
@@ -1706,6 +1904,7 @@ int build_node_manager(struct f2fs_sb_info *sbi)
 	if (init_node_manager(sbi))
 	 return -EINVAL;
 
+	build_free_nid_bitmap(sbi);
 	build_free_nids(sbi);
 	return 0;
 }
@@ -1723,9 +1922,10 @@ void destroy_node_manager(struct f2fs_sb_info *sbi)
 
 	/* destroy free nid list */
 	spin_lock(&nm_i->free_nid_list_lock);
+	BUG_ON(!list_empty(&nm_i->alloc_nid_list));
 	list_for_each_entry_safe(i, next_i, &nm_i->free_nid_list, list) {
 	 BUG_ON(i->state == NID_ALLOC);
-	 __del_from_free_nid_list(i);
+	 __del_from_free_nid_list(nm_i, i);
 	 nm_i->fcnt--;
 	}
 	BUG_ON(nm_i->fcnt);
@@ -1745,6 +1945,8 @@ void destroy_node_manager(struct f2fs_sb_info *sbi)
 	BUG_ON(nm_i->nat_cnt);
 	write_unlock(&nm_i->nat_tree_lock);
 
+	vfree(nm_i->free_nid_count);
+	vfree(nm_i->free_nid_bitmap);
 	kfree(nm_i->nat_bitmap);
 	sbi->nm_info = NULL;
 	kfree(nm_i);
@@ -15,6 +15,7 @@
 #define MAX_FREE_NIDS (NAT_ENTRY_PER_BLOCK * FREE_NID_PAGES)
 
 #define MAX_RA_NODE	 128	/* Max. readahead size for node */
+#define RA_NODE_BATCH	 64	/* # of nids gathered for a batched read */
 #define NM_WOUT_THRESHOLD	(64 * NAT_ENTRY_PER_BLOCK)
 #define NATVEC_SIZE	64
 
@@ -89,6 +90,29 @@ static inline int next_free_nid(struct f2fs_sb_info *sbi, nid_t *nid)
 	return 0;
 }
 
+/**
+ * For batched node readahead
+ */
+struct node_ra_batch {
+	int nr;
+	nid_t nids[RA_NODE_BATCH];
+};
+
+static inline void flush_node_ra(struct f2fs_sb_info *sbi,
+	 struct node_ra_batch *ra)
+{
+	ra_node_pages(sbi, ra->nids, ra->nr);
+	ra->nr = 0;
+}
+
+static inline void add_node_ra(struct f2fs_sb_info *sbi,
+	 struct node_ra_batch *ra, nid_t nid)
+{
+	ra->nids[ra->nr++] = nid;
+	if (ra->nr == RA_NODE_BATCH)
+	 flush_node_ra(sbi, ra);
+}
+
 /**
  * inline functions
  */
@@ -276,15 +300,10 @@ static inline nid_t get_nid(struct page *p, int off, bool i)
 
 /**
  * Coldness identification:
- * - Mark cold files in f2fs_inode_info
+ * - Mark the temperature of files in f2fs_inode_info
  * - Mark cold node blocks in their node footer
  * - Mark cold data pages in page cache
  */
-static inline int is_cold_file(struct inode *inode)
-{
-	return F2FS_I(inode)->is_cold;
-}
-
 static inline int is_cold_data(struct page *page)
 {
 	return PageChecked(page);
@@ -307,10 +326,15 @@ static inline int is_cold_node(struct page *page)
 	return rn->footer.cold;
 }
 
+/**
+ * Direct nodes of hot files join those of directories in the hot node log,
+ * except the fsynced ones which roll-forward recovery finds in the warm one.
+ */
 static inline void set_cold_node(struct inode *inode, struct page *page)
 {
 	struct f2fs_node *rn = (struct f2fs_node *)page_address(page);
-	if (S_ISDIR(inode->i_mode))
+	if (S_ISDIR(inode->i_mode) ||
+	 get_file_temp(F2FS_I(inode)) == F2FS_TEMP_HOT)
 	 rn->footer.cold = 0;
 	else
 	 rn->footer.cold = 1;
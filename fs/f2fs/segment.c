@@ -12,11 +12,16 @@
 #include <linux/f2fs_fs.h>
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/ioprio.h>
 
 #include "f2fs.h"
 #include "segment.h"
 #include "node.h"
 
+static struct kmem_cache *discard_entry_slab;
+
 static int need_to_flush(struct f2fs_sb_info *sbi)
 {
 	unsigned int pages_per_sec = 1 << (sbi->log_blocks_per_seg +
@@ -65,6 +70,80 @@ void f2fs_balance_fs(struct f2fs_sb_info *sbi)
 	}
 }
 
+static void __del_victim_index(struct victim_index *vi,
+	 struct victim_entry *ve)
+{
+	if (ve->bucket == NULL_BUCKET)
+	 return;
+	list_del(&ve->list);
+	if (list_empty(&vi->buckets[ve->bucket]))
+	 clear_bit(ve->bucket, vi->bucket_map);
+	ve->bucket = NULL_BUCKET;
+}
+
+static void __set_victim_index(struct victim_index *vi,
+	 struct victim_entry *ve, unsigned int bucket)
+{
+	if (ve->bucket == bucket)
+	 return;
+	__del_victim_index(vi, ve);
+	list_add_tail(&ve->list, &vi->buckets[bucket]);
+	set_bit(bucket, vi->bucket_map);
+	ve->bucket = bucket;
+}
+
+static unsigned int __sec_bucket(struct f2fs_sb_info *sbi, unsigned int segno)
+{
+	return get_valid_blocks(sbi, segno, sbi->log_segs_per_sec) >>
+	 sbi->log_segs_per_sec;
+}
+
+/**
+ * Move the victim entries of a given segment and its section to the buckets
+ * matching their current valid blocks.
+ * This function should be called under seglist_lock.
+ */
+static void __update_victim_entry(struct f2fs_sb_info *sbi, unsigned int segno)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	struct seg_entry *se = get_seg_entry(sbi, segno);
+	struct victim_entry *ve = &dirty_i->seg_ventries[segno];
+
+	if (ve->bucket != NULL_BUCKET)
+	 __set_victim_index(&dirty_i->ssr_index[se->type], ve,
+	 se->ckpt_valid_blocks);
+
+	ve = &dirty_i->sec_ventries[GET_SECNO(sbi, segno)];
+	if (ve->bucket != NULL_BUCKET)
+	 __set_victim_index(&dirty_i->gc_index, ve,
+	 __sec_bucket(sbi, segno));
+}
+
+static void __add_victim_entry(struct f2fs_sb_info *sbi, unsigned int segno)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	struct seg_entry *se = get_seg_entry(sbi, segno);
+	struct victim_entry *ve = &dirty_i->sec_ventries[GET_SECNO(sbi, segno)];
+
+	__set_victim_index(&dirty_i->ssr_index[se->type],
+	 &dirty_i->seg_ventries[segno], se->ckpt_valid_blocks);
+	if (!ve->nr_dirty++)
+	 __set_victim_index(&dirty_i->gc_index, ve,
+	 __sec_bucket(sbi, segno));
+}
+
+static void __del_victim_entry(struct f2fs_sb_info *sbi, unsigned int segno,
+	 enum dirty_type dirty_type)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	struct victim_entry *ve = &dirty_i->sec_ventries[GET_SECNO(sbi, segno)];
+
+	__del_victim_index(&dirty_i->ssr_index[dirty_type],
+	 &dirty_i->seg_ventries[segno]);
+	if (!--ve->nr_dirty)
+	 __del_victim_index(&dirty_i->gc_index, ve);
+}
+
 static void __locate_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno,
 	 enum dirty_type dirty_type)
 {
@@ -80,8 +159,11 @@ static void __locate_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno,
 	if (dirty_type == DIRTY) {
 	 struct seg_entry *sentry = get_seg_entry(sbi, segno);
 	 dirty_type = sentry->type;
-	 if (!test_and_set_bit(segno, dirty_i->dirty_segmap[dirty_type]))
+	 if (!test_and_set_bit(segno,
+	 dirty_i->dirty_segmap[dirty_type])) {
 	 dirty_i->nr_dirty[dirty_type]++;
+	 __add_victim_entry(sbi, segno);
+	 }
 	}
 }
 
@@ -97,8 +179,10 @@ static void __remove_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno,
 	 struct seg_entry *sentry = get_seg_entry(sbi, segno);
 	 dirty_type = sentry->type;
 	 if (test_and_clear_bit(segno,
-	 dirty_i->dirty_segmap[dirty_type]))
+	 dirty_i->dirty_segmap[dirty_type])) {
 	 dirty_i->nr_dirty[dirty_type]--;
+	 __del_victim_entry(sbi, segno, dirty_type);
+	 }
 	 clear_bit(segno, dirty_i->victim_segmap[FG_GC]);
 	 clear_bit(segno, dirty_i->victim_segmap[BG_GC]);
 	}
@@ -131,10 +215,279 @@ void locate_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno)
 	 __remove_dirty_segment(sbi, segno, DIRTY);
 	}
 
+	/* valid blocks may be changed, so reorder victim entries */
+	__update_victim_entry(sbi, segno);
+
 	mutex_unlock(&dirty_i->seglist_lock);
 	return;
 }
 
+/**
+ * Find the last discard entry starting at or before blkaddr, and its next.
+ * This should be called under discard_lock.
+ */
+static struct rb_node **__lookup_discard_entry(struct discard_info *dis_i,
+	 block_t blkaddr, struct rb_node **parent,
+	 struct discard_entry **prev, struct discard_entry **next)
+{
+	struct rb_node **p = &dis_i->root.rb_node;
+
+	*parent = NULL;
+	*prev = *next = NULL;
+	while (*p) {
+	 struct discard_entry *de;
+
+	 *parent = *p;
+	 de = rb_entry(*parent, struct discard_entry, rb_node);
+	 if (blkaddr < de->start) {
+	 *next = de;
+	 p = &(*p)->rb_left;
+	 } else {
+	 *prev = de;
+	 p = &(*p)->rb_right;
+	 }
+	}
+	return p;
+}
+
+static void __free_discard_entry(struct discard_info *dis_i,
+	 struct discard_entry *de)
+{
+	rb_erase(&de->rb_node, &dis_i->root);
+	dis_i->nr_extents--;
+	kmem_cache_free(discard_entry_slab, de);
+}
+
+/**
+ * Add [start, start + len) to the pending discard extents, merging it with
+ * the adjacent or overlapped ones. If we fail to get memory, the blocks
+ * are just not discarded.
+ * This should be called under discard_lock.
+ */
+static void __add_discard_extent(struct f2fs_sb_info *sbi, block_t start,
+	 block_t len)
+{
+	struct discard_info *dis_i = DISCARD_I(sbi);
+	struct discard_entry *de, *prev, *next;
+	struct rb_node **p, *parent;
+	block_t end = start + len;
+
+	p = __lookup_discard_entry(dis_i, start, &parent, &prev, &next);
+	dis_i->queued_blocks += len;
+
+	if (prev && prev->start + prev->len >= start) {
+	 de = prev;
+	 if (de->start + de->len < end) {
+	 dis_i->pending_blocks += end - (de->start + de->len);
+	 de->len = end - de->start;
+	 }
+	} else {
+	 de = kmem_cache_alloc(discard_entry_slab, GFP_NOFS);
+	 if (!de)
+	 return;
+	 de->start = start;
+	 de->len = len;
+	 rb_link_node(&de->rb_node, parent, p);
+	 rb_insert_color(&de->rb_node, &dis_i->root);
+	 dis_i->nr_extents++;
+	 dis_i->pending_blocks += len;
+	}
+
+	/* absorb the following extents */
+	while (next && next->start <= de->start + de->len) {
+	 struct rb_node *node = rb_next(&next->rb_node);
+	 block_t de_end = de->start + de->len;
+	 block_t next_end = next->start + next->len;
+
+	 dis_i->pending_blocks -= min(de_end, next_end) - next->start;
+	 if (next_end > de_end)
+	 de->len = next_end - de->start;
+	 __free_discard_entry(dis_i, next);
+	 next = node ? rb_entry(node, struct discard_entry, rb_node) :
+	 NULL;
+	}
+}
+
+static void queue_discard_segment(struct f2fs_sb_info *sbi, unsigned int segno)
+{
+	struct discard_info *dis_i = DISCARD_I(sbi);
+
+	mutex_lock(&dis_i->discard_lock);
+	/* it should be free not to discard new data */
+	if (!test_bit(segno, FREE_I(sbi)->free_segmap))
+	 __add_discard_extent(sbi, START_BLOCK(sbi, segno),
+	 sbi->blocks_per_seg);
+	mutex_unlock(&dis_i->discard_lock);
+}
+
+static bool __is_issuing(struct discard_info *dis_i, block_t start,
+	 block_t end)
+{
+	return dis_i->issue_len && start < dis_i->issue_start +
+	 dis_i->issue_len && dis_i->issue_start < end;
+}
+
+/**
+ * A free segment is going to be written, so remove it from the pending
+ * discard extents. If it is being discarded, wait for the completion.
+ */
+static void remove_discard_segment(struct f2fs_sb_info *sbi,
+	 unsigned int segno)
+{
+	struct discard_info *dis_i = DISCARD_I(sbi);
+	block_t start = START_BLOCK(sbi, segno);
+	block_t end = start + sbi->blocks_per_seg;
+	struct discard_entry *de, *next;
+	struct rb_node *parent;
+	block_t de_end;
+
+	mutex_lock(&dis_i->discard_lock);
+	while (__is_issuing(dis_i, start, end)) {
+	 mutex_unlock(&dis_i->discard_lock);
+	 wait_event(dis_i->issue_wait,
+	 !__is_issuing(dis_i, start, end));
+	 mutex_lock(&dis_i->discard_lock);
+	}
+
+	__lookup_discard_entry(dis_i, start, &parent, &de, &next);
+	if (!de || de->start + de->len <= start)
+	 goto out;
+
+	de_end = de->start + de->len;
+	dis_i->pending_blocks -= sbi->blocks_per_seg;
+	if (de->start == start && de_end == end) {
+	 __free_discard_entry(dis_i, de);
+	} else if (de->start == start) {
+	 de->start = end;
+	 de->len = de_end - end;
+	} else {
+	 de->len = start - de->start;
+	 if (de_end > end) {
+	 /* the tail is not discarded if we fail to split */
+	 dis_i->pending_blocks -= de_end - end;
+	 dis_i->queued_blocks -= de_end - end;
+	 __add_discard_extent(sbi, end, de_end - end);
+	 }
+	}
+out:
+	mutex_unlock(&dis_i->discard_lock);
+}
+
+/**
+ * Issue the pending extents within [start, end) having minlen blocks at least,
+ * up to max_cmds discard commands. Return the number of discarded blocks.
+ * A command covers a section at most, so that remove_discard_segment() does
+ * not wait long under the allocator locks. The rest of a longer extent stays
+ * pending and is issued by the next commands.
+ */
+unsigned long long issue_discard_extents(struct f2fs_sb_info *sbi,
+	 block_t start, block_t end, block_t minlen,
+	 unsigned int max_cmds)
+{
+	struct discard_info *dis_i = DISCARD_I(sbi);
+	block_t max_len = sbi->blocks_per_seg * sbi->segs_per_sec;
+	block_t rest = NULL_ADDR;
+	unsigned long long issued = 0;
+	unsigned int cmds = 0;
+
+	mutex_lock(&dis_i->issue_lock);
+	mutex_lock(&dis_i->discard_lock);
+	while (cmds < max_cmds) {
+	 struct discard_entry *de, *next;
+	 struct rb_node *parent, *node;
+
+	 __lookup_discard_entry(dis_i, start, &parent, &de, &next);
+	 if (!de || de->start + de->len <= start)
+	 de = next;
+	 while (de && de->start < end && de->len < minlen &&
+	 de->start != rest) {
+	 node = rb_next(&de->rb_node);
+	 de = node ? rb_entry(node, struct discard_entry,
+	 rb_node) : NULL;
+	 }
+	 if (!de || de->start >= end)
+	 break;
+
+	 dis_i->issue_start = de->start;
+	 dis_i->issue_len = min(de->len, max_len);
+	 dis_i->pending_blocks -= dis_i->issue_len;
+	 start = de->start + dis_i->issue_len;
+	 if (dis_i->issue_len == de->len) {
+	 __free_discard_entry(dis_i, de);
+	 rest = NULL_ADDR;
+	 } else {
+	 /* it keeps its place in the tree */
+	 de->start = start;
+	 de->len -= dis_i->issue_len;
+	 rest = start;
+	 }
+	 mutex_unlock(&dis_i->discard_lock);
+
+	 blkdev_issue_discard(sbi->sb->s_bdev,
+	 (sector_t)dis_i->issue_start <<
+	 sbi->log_sectors_per_block,
+	 (sector_t)dis_i->issue_len <<
+	 sbi->log_sectors_per_block,
+	 GFP_NOFS, 0);
+
+	 mutex_lock(&dis_i->discard_lock);
+	 issued += dis_i->issue_len;
+	 dis_i->issued_blocks += dis_i->issue_len;
+	 dis_i->issued_cmds++;
+	 dis_i->issue_len = 0;
+	 wake_up(&dis_i->issue_wait);
+	 cmds++;
+	}
+	mutex_unlock(&dis_i->discard_lock);
+	mutex_unlock(&dis_i->issue_lock);
+	return issued;
+}
+
+void flush_discard_extents(struct f2fs_sb_info *sbi)
+{
+	issue_discard_extents(sbi, 0, (block_t)~0, 1, UINT_MAX);
+}
+
+/**
+ * FITRIM queues all the free segments in the range, and issues
+ * the pending extents there synchronously.
+ */
+int f2fs_trim_fs(struct f2fs_sb_info *sbi, struct fstrim_range *range)
+{
+	struct free_segmap_info *free_i = FREE_I(sbi);
+	__u64 start = range->start >> sbi->log_blocksize;
+	__u64 end = start + (range->len >> sbi->log_blocksize);
+	block_t minlen = range->minlen >> sbi->log_blocksize;
+	block_t main_start = START_BLOCK(sbi, 0);
+	block_t main_end = START_BLOCK(sbi, TOTAL_SEGS(sbi));
+	unsigned int start_segno, end_segno, segno;
+	unsigned long long trimmed = 0;
+
+	if (range->len < sbi->blocksize)
+	 return -EINVAL;
+	if (end <= main_start || start >= main_end)
+	 goto out;
+
+	start_segno = (start <= main_start) ? 0 : GET_SEGNO(sbi, start);
+	end_segno = (end >= main_end) ? TOTAL_SEGS(sbi) :
+	 GET_SEGNO(sbi, end - 1) + 1;
+
+	segno = find_next_zero_bit(free_i->free_segmap, end_segno,
+	 start_segno);
+	while (segno < end_segno) {
+	 queue_discard_segment(sbi, segno);
+	 segno = find_next_zero_bit(free_i->free_segmap, end_segno,
+	 segno + 1);
+	}
+
+	trimmed = issue_discard_extents(sbi, START_BLOCK(sbi, start_segno),
+	 START_BLOCK(sbi, end_segno), max(minlen, 1U),
+	 UINT_MAX);
+out:
+	range->len = trimmed << sbi->log_blocksize;
+	return 0;
+}
+
 /**
  * Should call clear_prefree_segments after checkpoint is done.
  */
@@ -173,14 +526,9 @@ void clear_prefree_segments(struct f2fs_sb_info *sbi)
 	 if (test_and_clear_bit(segno, dirty_i->dirty_segmap[PRE]))
 	 dirty_i->nr_dirty[PRE]--;
 
-	 /* Let's use trim */
+	 /* Let's use trim in background */
 	 if (test_opt(sbi, DISCARD))
-	 blkdev_issue_discard(sbi->sb->s_bdev,
-	 START_BLOCK(sbi, segno) <<
-	 sbi->log_sectors_per_block,
-	 1 << (sbi->log_sectors_per_block +
-	 sbi->log_blocks_per_seg),
-	 GFP_NOFS, 0);
+	 queue_discard_segment(sbi, segno);
 	}
 	mutex_unlock(&dirty_i->seglist_lock);
 }
@@ -206,6 +554,7 @@ static void update_sit_entry(struct f2fs_sb_info *sbi, block_t blkaddr, int del)
 	struct seg_entry *se;
 	unsigned int segno, offset;
 	long int new_vblocks;
+	unsigned long long mtime;
 
 	segno = GET_SEGNO(sbi, blkaddr);
 
@@ -217,8 +566,11 @@ static void update_sit_entry(struct f2fs_sb_info *sbi, block_t blkaddr, int del)
 	 (new_vblocks > sbi->blocks_per_seg)));
 
 	se->valid_blocks = new_vblocks;
-	se->mtime = get_mtime(sbi);
-	SIT_I(sbi)->max_mtime = se->mtime;
+	mtime = get_mtime(sbi);
+	if (sbi->log_segs_per_sec)
+	 get_sec_entry(sbi, segno)->mtime += mtime - se->mtime;
+	se->mtime = mtime;
+	update_min_max_mtime(SIT_I(sbi), get_sec_mtime(sbi, segno));
 
 	/* Update valid block bitmap */
 	if (del > 0) {
@@ -370,6 +722,66 @@ next:
 	return NULL_SEGNO;
 }
 
+/**
+ * Find the first free section from start to the right.
+ * Fully used words of free_secmap are skipped by its summary bitmap.
+ * Returns total_sections if there is no free section.
+ */
+static unsigned int __find_next_free_sec(struct f2fs_sb_info *sbi,
+	 unsigned int start)
+{
+	struct free_segmap_info *free_i = FREE_I(sbi);
+	unsigned int total_secs = sbi->total_sections;
+	unsigned int nr_words = BITS_TO_LONGS(total_secs);
+	unsigned int word, end, secno;
+
+	if (start >= total_secs)
+	 return total_secs;
+
+	/* search the rest of the word including start */
+	word = BIT_WORD(start);
+	end = min(total_secs, (word + 1) * (unsigned int)BITS_PER_LONG);
+	secno = find_next_zero_bit(free_i->free_secmap, end, start);
+	if (secno < end)
+	 return secno;
+
+	word = find_next_bit(free_i->free_secmap_sum, nr_words, word + 1);
+	if (word >= nr_words)
+	 return total_secs;
+	return word * BITS_PER_LONG + ffz(free_i->free_secmap[word]);
+}
+
+/**
+ * Find the first free section from start to the left.
+ * Returns total_sections if there is no free section.
+ */
+static unsigned int __find_prev_free_sec(struct f2fs_sb_info *sbi,
+	 unsigned int start)
+{
+	struct free_segmap_info *free_i = FREE_I(sbi);
+	unsigned int total_secs = sbi->total_sections;
+	unsigned int word, ofs;
+	unsigned long free_bits;
+
+	if (start >= total_secs)
+	 return total_secs;
+
+	/* search the bits of the word including start in reverse */
+	word = BIT_WORD(start);
+	ofs = start % BITS_PER_LONG;
+	free_bits = ~free_i->free_secmap[word] &
+	 (~0UL >> (BITS_PER_LONG - 1 - ofs));
+	if (free_bits)
+	 return word * BITS_PER_LONG + __fls(free_bits);
+	if (!word)
+	 return total_secs;
+
+	ofs = find_last_bit(free_i->free_secmap_sum, word);
+	if (ofs >= word)
+	 return total_secs;
+	return ofs * BITS_PER_LONG + __fls(~free_i->free_secmap[ofs]);
+}
+
 /**
  * Find a new segment from the free segments bitmap to right order
  * This function should be returned with success, otherwise BUG
@@ -391,17 +803,19 @@ static void get_new_segment(struct f2fs_sb_info *sbi,
 	write_lock(&free_i->segmap_lock);
 
 	if (!new_sec && ((*newseg + 1) % sbi->segs_per_sec)) {
+	 unsigned int end_segno = (hint + 1) << sbi->log_segs_per_sec;
+
+	 /* the rest of the current section comes first */
 	 segno = find_next_zero_bit(free_i->free_segmap,
-	 TOTAL_SEGS(sbi), *newseg + 1);
-	 if (segno < TOTAL_SEGS(sbi))
+	 end_segno, *newseg + 1);
+	 if (segno < end_segno)
 	 goto got_it;
 	}
 find_other_zone:
-	secno = find_next_zero_bit(free_i->free_secmap, total_secs, hint);
+	secno = __find_next_free_sec(sbi, hint);
 	if (secno >= total_secs) {
 	 if (dir == ALLOC_RIGHT) {
-	 secno = find_next_zero_bit(free_i->free_secmap,
-	 total_secs, 0);
+	 secno = __find_next_free_sec(sbi, 0);
 	 BUG_ON(secno >= total_secs);
 	 } else {
 	 go_left = 1;
@@ -411,17 +825,11 @@ find_other_zone:
 	if (go_left == 0)
 	 goto skip_left;
 
-	while (test_bit(left_start, free_i->free_secmap)) {
-	 if (left_start > 0) {
-	 left_start--;
-	 continue;
-	 }
-	 left_start = find_next_zero_bit(free_i->free_secmap,
-	 total_secs, 0);
-	 BUG_ON(left_start >= total_secs);
-	 break;
+	secno = __find_prev_free_sec(sbi, left_start);
+	if (secno >= total_secs) {
+	 secno = __find_next_free_sec(sbi, 0);
+	 BUG_ON(secno >= total_secs);
 	}
-	secno = left_start;
 skip_left:
 	hint = secno;
 	segno = secno << sbi->log_segs_per_sec;
@@ -438,16 +846,18 @@ skip_left:
 	 goto got_it;
 	}
 
-	for (i = 0; i < DEFAULT_CURSEGS; i++) {
+	for (i = 0; i < NR_CURSEGS(sbi); i++) {
 	 struct curseg_info *curseg = CURSEG_I(sbi, i);
 
+	 if (curseg->segno == NULL_SEGNO)
+	 continue;
 	 if (curseg->zone != zoneno)
 	 continue;
 	 if (!init)
 	 continue;
 
 	 if (go_left)
-	 hint = zoneno * sbi->secs_per_zone - 1;
+	 left_start = hint = zoneno * sbi->secs_per_zone - 1;
 	 else if (zoneno + 1 >= total_zones)
 	 hint = 0;
 	 else
@@ -468,10 +878,14 @@ static void reset_curseg(struct f2fs_sb_info *sbi, int type, int modified)
 	struct curseg_info *curseg = CURSEG_I(sbi, type);
 	struct summary_footer *sum_footer;
 
+	type = curseg_log_type(type);
+
 	curseg->segno = curseg->next_segno;
 	curseg->zone = GET_ZONENO_FROM_SEGNO(sbi, curseg->segno);
 	curseg->next_blkoff = 0;
 	curseg->next_segno = NULL_SEGNO;
+	curseg->last_ino = 0;
+	curseg->nr_runs = 0;
 
 	sum_footer = &(curseg->sum_blk->footer);
 	memset(sum_footer, 0, sizeof(struct summary_footer));
@@ -490,17 +904,23 @@ static void new_curseg(struct f2fs_sb_info *sbi, int type, bool new_sec)
 {
 	struct curseg_info *curseg = CURSEG_I(sbi, type);
 	unsigned int segno = curseg->segno;
+	int log_type = curseg_log_type(type);
 	int dir = ALLOC_LEFT;
 
-	write_sum_page(sbi, curseg->sum_blk,
+	/* a private data log is opened near its default log */
+	if (segno == NULL_SEGNO)
+	 segno = CURSEG_I(sbi, log_type)->segno;
+	else
+	 write_sum_page(sbi, curseg->sum_blk,
 	 GET_SUM_BLOCK(sbi, curseg->segno));
-	if (type == CURSEG_WARM_DATA || type == CURSEG_COLD_DATA)
+	if (log_type == CURSEG_WARM_DATA || log_type == CURSEG_COLD_DATA)
 	 dir = ALLOC_RIGHT;
 
 	if (test_opt(sbi, NOHEAP))
 	 dir = ALLOC_RIGHT;
 
 	get_new_segment(sbi, &segno, new_sec, dir);
+	remove_discard_segment(sbi, segno);
 	curseg->next_segno = segno;
 	reset_curseg(sbi, type, 1);
 	curseg->alloc_type = LFS;
@@ -574,6 +994,7 @@ static void allocate_segment_by_default(struct f2fs_sb_info *sbi,
 	 int type, bool force)
 {
 	struct curseg_info *curseg = CURSEG_I(sbi, type);
+	int log_type = curseg_log_type(type);
 	unsigned int log_ofs_unit;
 
 	if (force) {
@@ -582,13 +1003,14 @@ static void allocate_segment_by_default(struct f2fs_sb_info *sbi,
 	}
 
 	log_ofs_unit = need_SSR(sbi) ? 0 : sbi->log_segs_per_sec;
-	curseg->next_segno = check_prefree_segments(sbi, log_ofs_unit, type);
+	curseg->next_segno = check_prefree_segments(sbi, log_ofs_unit,
+	 log_type);
 
 	if (curseg->next_segno != NULL_SEGNO)
 	 change_curseg(sbi, type, false);
-	else if (type == CURSEG_WARM_NODE)
+	else if (log_type == CURSEG_WARM_NODE)
 	 new_curseg(sbi, type, false);
-	else if (need_SSR(sbi) && IS_NEXT_SEG(sbi, curseg, type))
+	else if (need_SSR(sbi) && IS_NEXT_SEG(sbi, curseg, log_type))
 	 change_curseg(sbi, type, true);
 	else
 	 new_curseg(sbi, type, false);
@@ -614,11 +1036,28 @@ static const struct segment_allocation default_salloc_ops = {
 	.allocate_segment = allocate_segment_by_default,
 };
 
+static void account_io_class(struct f2fs_sb_info *sbi,
+	 struct bio_private *p, unsigned int nr_pages)
+{
+	struct f2fs_io_stat *ios = &sbi->io_stat[p->io_class];
+	u64 lat_us = ktime_to_us(ktime_get()) - p->submit_us;
+
+	atomic_inc(&ios->bios);
+	atomic64_add((u64)nr_pages << PAGE_CACHE_SHIFT, &ios->bytes);
+	atomic64_add(lat_us, &ios->lat_us);
+	/* it does not matter to miss a max. value by a race */
+	if (lat_us > ios->max_lat_us)
+	 ios->max_lat_us = lat_us;
+}
+
 static void f2fs_end_io_write(struct bio *bio, int err)
 {
 	const int uptodate = test_bit(BIO_UPTODATE, &bio->bi_flags);
 	struct bio_vec *bvec = bio->bi_io_vec + bio->bi_vcnt - 1;
-	struct bio_private *p = bio->bi_private;
+	struct bio_private *p = F2FS_BIO_PRIVATE(bio);
+	struct f2fs_sb_info *sbi = p->sbi;
+	struct completion *wait = p->is_sync ? p->wait : NULL;
+	int nr_pages = bio->bi_vcnt;
 
 	do {
 	 struct page *page = bvec->bv_page;
@@ -629,111 +1068,160 @@ static void f2fs_end_io_write(struct bio *bio, int err)
 	 SetPageError(page);
 	 if (page->mapping)
 	 set_bit(AS_EIO, &page->mapping->flags);
-	 p->sbi->ckpt->ckpt_flags |= CP_ERROR_FLAG;
+	 sbi->ckpt->ckpt_flags |= CP_ERROR_FLAG;
 	 set_page_dirty(page);
 	 }
 	 end_page_writeback(page);
-	 dec_page_count(p->sbi, F2FS_WRITEBACK);
 	} while (bvec >= bio->bi_io_vec);
+	account_io_class(sbi, p, nr_pages);
 
-	if (p->is_sync)
-	 complete(p->wait);
-	kfree(p);
+	/*
+	 * Return the bio to the pool of the partition before anyone waiting
+	 * for the writeback can go on to tear the pool down at umount.
+	 */
 	bio_put(bio);
+	sub_page_count(sbi, F2FS_WRITEBACK, nr_pages);
+	if (wait)
+	 complete(wait);
 }
 
-struct bio *f2fs_bio_alloc(struct block_device *bdev, sector_t first_sector,
-	 int nr_vecs, gfp_t gfp_flags)
+/**
+ * Allocation from the mempool of the partition does not fail as long as
+ * gfp_flags allows waiting, since in-flight bios are returned to the pool.
+ */
+static struct bio *f2fs_bio_alloc(struct f2fs_sb_info *sbi,
+	 sector_t first_sector, int nr_vecs, gfp_t gfp_flags)
 {
 	struct bio *bio;
-repeat:
-	/* allocate new bio */
-	bio = bio_alloc(gfp_flags, nr_vecs);
-
-	if (bio == NULL && (current->flags & PF_MEMALLOC)) {
-	 while (!bio && (nr_vecs /= 2))
-	 bio = bio_alloc(gfp_flags, nr_vecs);
-	}
-	if (bio) {
-	 bio->bi_bdev = bdev;
-	 bio->bi_sector = first_sector;
-retry:
-	 bio->bi_private = kmalloc(sizeof(struct bio_private),
-	 GFP_NOFS | __GFP_HIGH);
-	 if (!bio->bi_private) {
-	 cond_resched();
-	 goto retry;
-	 }
-	}
-	if (bio == NULL) {
-	 cond_resched();
-	 goto repeat;
-	}
+
+	bio = bio_alloc_bioset(gfp_flags, nr_vecs, SM_I(sbi)->bio_set);
+	bio->bi_bdev = sbi->sb->s_bdev;
+	bio->bi_sector = first_sector;
 	return bio;
 }
 
+/**
+ * Caller should hold io->io_mutex.
+ */
 static void do_submit_bio(struct f2fs_sb_info *sbi,
-	 enum page_type type, bool sync)
+	 struct f2fs_bio_info *io, enum page_type type, bool sync)
 {
 	int rw = sync ? WRITE_SYNC : WRITE;
-	enum page_type btype = type > META ? META : type;
+	struct bio_private *p;
 
-	if (type >= META_FLUSH)
+	if (!io->bio)
+	 return;
+
+	if (type >= META_FLUSH) {
 	 rw = WRITE_FLUSH_FUA;
+	} else if (io->io_class == F2FS_IO_GC) {
+	 bio_set_prio(io->bio,
+	 IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, IOPRIO_BE_NR - 1));
+	}
 
-	if (sbi->bio[btype]) {
-	 struct bio_private *p = sbi->bio[btype]->bi_private;
-	 p->sbi = sbi;
-	 sbi->bio[btype]->bi_end_io = f2fs_end_io_write;
-	 if (type == META_FLUSH) {
+	p = F2FS_BIO_PRIVATE(io->bio);
+	p->sbi = sbi;
+	p->io_class = io->io_class;
+	p->submit_us = ktime_to_us(ktime_get());
+	io->bio->bi_end_io = f2fs_end_io_write;
+	if (type == META_FLUSH) {
 	 DECLARE_COMPLETION_ONSTACK(wait);
 	 p->is_sync = true;
 	 p->wait = &wait;
-	 submit_bio(rw, sbi->bio[btype]);
+	 submit_bio(rw, io->bio);
 	 wait_for_completion(&wait);
-	 } else {
+	} else {
 	 p->is_sync = false;
-	 submit_bio(rw, sbi->bio[btype]);
-	 }
-	 sbi->bio[btype] = NULL;
+	 submit_bio(rw, io->bio);
 	}
+	io->bio = NULL;
 }
 
+static void submit_io_bio(struct f2fs_sb_info *sbi,
+	 struct f2fs_bio_info *io, enum page_type type, bool sync)
+{
+	mutex_lock(&io->io_mutex);
+	do_submit_bio(sbi, io, type, sync);
+	mutex_unlock(&io->io_mutex);
+}
+
+/**
+ * Submit the bios under assembly for the given page type.
+ * The bios of the logs go first, so that META_FLUSH is issued last.
+ */
 void f2fs_submit_bio(struct f2fs_sb_info *sbi, enum page_type type, bool sync)
 {
-	down_write(&sbi->bio_sem);
-	do_submit_bio(sbi, type, sync);
-	up_write(&sbi->bio_sem);
+	enum page_type btype = type > META ? META : type;
+	int i;
+
+	if (btype != META) {
+	 for (i = 0; i < NR_CURSEGS(sbi); i++) {
+	 int log_type = curseg_log_type(i);
+
+	 if ((btype == DATA) != IS_DATASEG(log_type))
+	 continue;
+	 submit_io_bio(sbi, &CURSEG_I(sbi, i)->io, type, sync);
+	 }
+	}
+	submit_io_bio(sbi, &sbi->write_io[btype], type, sync);
 }
 
+/**
+ * The writes by checkpoint and GC are told by the task holding them.
+ * The data pages moved by background GC are written back later with their
+ * cold mark set. Foreground GC blocks the writer waiting for free sections,
+ * so its writes, cold data pages included, stay in the foreground class.
+ */
+static int __get_io_class(struct f2fs_sb_info *sbi, struct page *page,
+	 enum page_type type)
+{
+	if (type == META || sbi->cp_task == current)
+	 return F2FS_IO_CP;
+	if (sbi->gc_task == current)
+	 return sbi->gc_fg ? F2FS_IO_FG : F2FS_IO_GC;
+	if (type == DATA && is_cold_data(page))
+	 return F2FS_IO_GC;
+	return F2FS_IO_FG;
+}
+
+/**
+ * A bio is submitted only when the next block is not contiguous, i.e., at
+ * segment boundaries of a log, when it is full, or when the next page is of
+ * another I/O class. Since each log builds its own bio, writers to different
+ * logs do not contend on io_mutex.
+ */
 static void submit_write_page(struct f2fs_sb_info *sbi, struct page *page,
-	 block_t blk_addr, enum page_type type)
+	 block_t blk_addr, struct f2fs_bio_info *io, enum page_type type)
 {
 	struct block_device *bdev = sbi->sb->s_bdev;
+	int io_class = __get_io_class(sbi, page, type);
 
 	verify_block_addr(sbi, blk_addr);
 
-	down_write(&sbi->bio_sem);
+	mutex_lock(&io->io_mutex);
 
 	inc_page_count(sbi, F2FS_WRITEBACK);
 
-	if (sbi->bio[type] && sbi->last_block_in_bio[type] != blk_addr - 1)
-	 do_submit_bio(sbi, type, false);
+	if (io->bio && (io->last_block_in_bio != blk_addr - 1 ||
+	 io->io_class != io_class))
+	 do_submit_bio(sbi, io, type, false);
 alloc_new:
-	if (sbi->bio[type] == NULL)
-	 sbi->bio[type] = f2fs_bio_alloc(bdev,
+	if (io->bio == NULL) {
+	 io->bio = f2fs_bio_alloc(sbi,
 	 blk_addr << (sbi->log_blocksize - 9),
 	 bio_get_nr_vecs(bdev), GFP_NOFS | __GFP_HIGH);
+	 io->io_class = io_class;
+	}
 
-	if (bio_add_page(sbi->bio[type], page, PAGE_CACHE_SIZE, 0) <
+	if (bio_add_page(io->bio, page, PAGE_CACHE_SIZE, 0) <
 	 PAGE_CACHE_SIZE) {
-	 do_submit_bio(sbi, type, false);
+	 do_submit_bio(sbi, io, type, false);
 	 goto alloc_new;
 	}
 
-	sbi->last_block_in_bio[type] = blk_addr;
+	io->last_block_in_bio = blk_addr;
 
-	up_write(&sbi->bio_sem);
+	mutex_unlock(&io->io_mutex);
 }
 
 static bool __has_curseg_space(struct f2fs_sb_info *sbi, int type)
@@ -744,24 +1232,113 @@ static bool __has_curseg_space(struct f2fs_sb_info *sbi, int type)
 	return false;
 }
 
-static int __get_segment_type(struct page *page, enum page_type p_type)
+/**
+ * Count the runs of blocks from different files in the segment of a log,
+ * and account them when the segment is filled up. This should be called
+ * under sentry_lock after a block is allocated.
+ */
+static void __account_log_fill(struct f2fs_sb_info *sbi, int type, nid_t ino)
+{
+	struct curseg_info *curseg = CURSEG_I(sbi, type);
+	int log_type = curseg_log_type(type);
+
+	if (!curseg->nr_runs || curseg->last_ino != ino) {
+	 curseg->last_ino = ino;
+	 curseg->nr_runs++;
+	}
+	if (!__has_curseg_space(sbi, type)) {
+	 sbi->log_segs[log_type]++;
+	 sbi->log_runs[log_type] += curseg->nr_runs;
+	}
+}
+
+/**
+ * The page is NULL for the blocks of direct writes
+ */
+static int __get_data_segment_type(struct inode *inode, struct page *page)
 {
-	if (p_type == DATA) {
-	 struct inode *inode = page->mapping->host;
+	int type;
 
-	 if (S_ISDIR(inode->i_mode))
+	if (S_ISDIR(inode->i_mode))
 	 return CURSEG_HOT_DATA;
-	 else if (is_cold_data(page) || is_cold_file(inode))
+	else if (page && is_cold_data(page))
 	 return CURSEG_COLD_DATA;
-	 else
+
+	switch (get_file_temp(F2FS_I(inode))) {
+	case F2FS_TEMP_HOT:
+	 return CURSEG_HOT_DATA;
+	case F2FS_TEMP_WARM:
 	 return CURSEG_WARM_DATA;
-	} else {
-	 if (IS_DNODE(page))
-	 return is_cold_node(page) ? CURSEG_WARM_NODE :
-	 CURSEG_HOT_NODE;
-	 else
+	case F2FS_TEMP_COLD:
+	 return CURSEG_COLD_DATA;
+	}
+
+	type = get_write_temp(inode);
+	atomic_inc(&F2FS_SB(inode->i_sb)->temp_count[type]);
+	return type;
+}
+
+static int __get_segment_type(struct page *page, enum page_type p_type)
+{
+	if (p_type == DATA)
+	 return __get_data_segment_type(page->mapping->host, page);
+
+	if (IS_DNODE(page))
+	 return (is_cold_node(page) || is_fsync_dnode(page)) ?
+	 CURSEG_WARM_NODE : CURSEG_HOT_NODE;
+	else
 	 return CURSEG_COLD_NODE;
+}
+
+/**
+ * Pick the data log of the running cpu's group when multi-head logging is
+ * enabled, so that concurrent writers do not serialize on one curseg_mutex.
+ * Node logs and roll-forward recovery always use the default logs.
+ */
+static int __get_curseg_head(struct f2fs_sb_info *sbi, int type)
+{
+	unsigned int nr_heads = SM_I(sbi)->nr_data_heads;
+	unsigned int head;
+
+	if (nr_heads <= 1 || !IS_DATASEG(type) || sbi->por_doing)
+	 return type;
+
+	head = raw_smp_processor_id() * nr_heads / nr_cpu_ids;
+	if (!head)
+	 return type;
+	return NR_CURSEG_TYPE + (head - 1) * NR_CURSEG_DATA_TYPE + type;
+}
+
+/**
+ * Returns with the curseg_mutex of the selected log held.
+ * A private data log is opened at its first use, but it falls back to the
+ * default log if free sections are too scarce to open a new one.
+ */
+static struct curseg_info *lock_curseg_head(struct f2fs_sb_info *sbi,
+	 int *type)
+{
+	struct sit_info *sit_i = SIT_I(sbi);
+	int head = __get_curseg_head(sbi, *type);
+	struct curseg_info *curseg = CURSEG_I(sbi, head);
+
+	mutex_lock(&curseg->curseg_mutex);
+	if (curseg->segno != NULL_SEGNO)
+	 goto out;
+
+	if (need_SSR(sbi)) {
+	 mutex_unlock(&curseg->curseg_mutex);
+	 head = *type;
+	 curseg = CURSEG_I(sbi, head);
+	 mutex_lock(&curseg->curseg_mutex);
+	 goto out;
 	}
+
+	mutex_lock(&sit_i->sentry_lock);
+	sit_i->s_ops->allocate_segment(sbi, head, true);
+	mutex_unlock(&sit_i->sentry_lock);
+out:
+	*type = head;
+	return curseg;
 }
 
 static void do_write_page(struct f2fs_sb_info *sbi, struct page *page,
@@ -774,9 +1351,7 @@ static void do_write_page(struct f2fs_sb_info *sbi, struct page *page,
 	int type;
 
 	type = __get_segment_type(page, p_type);
-	curseg = CURSEG_I(sbi, type);
-
-	mutex_lock(&curseg->curseg_mutex);
+	curseg = lock_curseg_head(sbi, &type);
 
 	*new_blkaddr = NEXT_FREE_BLKADDR(sbi, curseg);
 	old_cursegno = curseg->segno;
@@ -797,6 +1372,8 @@ static void do_write_page(struct f2fs_sb_info *sbi, struct page *page,
 	 * since SSR needs latest valid block information.
 	 */
 	refresh_sit_entry(sbi, old_blkaddr, *new_blkaddr);
+	__account_log_fill(sbi, type, (p_type == NODE) ? ino_of_node(page) :
+	 page->mapping->host->i_ino);
 
 	if (!__has_curseg_space(sbi, type))
 	 sit_i->s_ops->allocate_segment(sbi, type, false);
@@ -809,7 +1386,7 @@ static void do_write_page(struct f2fs_sb_info *sbi, struct page *page,
 	 fill_node_footer_blkaddr(page, NEXT_FREE_BLKADDR(sbi, curseg));
 
 	/* writeout dirty page into bdev */
-	submit_write_page(sbi, page, *new_blkaddr, p_type);
+	submit_write_page(sbi, page, *new_blkaddr, &curseg->io, p_type);
 
 	mutex_unlock(&curseg->curseg_mutex);
 }
@@ -821,7 +1398,7 @@ int write_meta_page(struct f2fs_sb_info *sbi, struct page *page,
 	 return AOP_WRITEPAGE_ACTIVATE;
 
 	set_page_writeback(page);
-	submit_write_page(sbi, page, page->index, META);
+	submit_write_page(sbi, page, page->index, &sbi->write_io[META], META);
 	return 0;
 }
 
@@ -833,26 +1410,173 @@ void write_node_page(struct f2fs_sb_info *sbi, struct page *page,
 	do_write_page(sbi, page, old_blkaddr, new_blkaddr, &sum, NODE);
 }
 
-void write_data_page(struct inode *inode, struct page *page,
-	 struct dnode_of_data *dn, block_t old_blkaddr,
-	 block_t *new_blkaddr)
-{
-	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
-	struct f2fs_summary sum;
-	struct node_info ni;
-
-	BUG_ON(old_blkaddr == NULL_ADDR);
-	get_node_info(sbi, dn->nid, &ni);
-	set_summary(&sum, dn->nid, dn->ofs_in_node, ni.version);
+void write_data_page(struct inode *inode, struct page *page,
+	 struct dnode_of_data *dn, block_t old_blkaddr,
+	 block_t *new_blkaddr)
+{
+	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
+	struct f2fs_summary sum;
+	struct node_info ni;
+
+	BUG_ON(old_blkaddr == NULL_ADDR);
+	get_node_info(sbi, dn->nid, &ni);
+	set_summary(&sum, dn->nid, dn->ofs_in_node, ni.version);
+
+	do_write_page(sbi, page, old_blkaddr,
+	 new_blkaddr, &sum, DATA);
+}
+
+/**
+ * Write a batch of data pages sharing the dnode of dn, whose ofs_in_node
+ * points to the first page. blkaddrs has the old block addresses of the
+ * pages on entry and their new ones on return.
+ * The summaries and SIT entries of a run of pages going to the same log are
+ * updated under one hold of its curseg_mutex and sentry_lock, and then the
+ * pages are merged into the bio of the log.
+ */
+void write_data_pages(struct inode *inode, struct dnode_of_data *dn,
+	 struct page **pages, block_t *blkaddrs, unsigned int nr)
+{
+	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
+	struct sit_info *sit_i = SIT_I(sbi);
+	struct curseg_info *curseg;
+	struct f2fs_summary sum;
+	struct node_info ni;
+	unsigned char types[WRITE_BATCH_PAGES];
+	unsigned int old_cursegno, ofs_in_node;
+	unsigned int start, i;
+	int type;
+
+	BUG_ON(nr > WRITE_BATCH_PAGES);
+	get_node_info(sbi, dn->nid, &ni);
+
+	for (i = 0; i < nr; i++)
+	 types[i] = __get_segment_type(pages[i], DATA);
+
+	for (start = 0; start < nr; start = i) {
+	 type = types[start];
+	 curseg = lock_curseg_head(sbi, &type);
+	 old_cursegno = curseg->segno;
+
+	 mutex_lock(&sit_i->sentry_lock);
+	 for (i = start; i < nr && types[i] == types[start]; i++) {
+	 block_t old_blkaddr = blkaddrs[i];
+
+	 BUG_ON(old_blkaddr == NULL_ADDR);
+	 ofs_in_node = dn->ofs_in_node +
+	 pages[i]->index - pages[0]->index;
+	 set_summary(&sum, dn->nid, ofs_in_node, ni.version);
+
+	 blkaddrs[i] = NEXT_FREE_BLKADDR(sbi, curseg);
+	 __add_sum_entry(sbi, type, &sum, curseg->next_blkoff);
+	 __refresh_next_blkoff(sbi, curseg);
+	 sbi->block_count[curseg->alloc_type]++;
+
+	 refresh_sit_entry(sbi, old_blkaddr, blkaddrs[i]);
+	 locate_dirty_segment(sbi, GET_SEGNO(sbi, old_blkaddr));
+	 __account_log_fill(sbi, type, inode->i_ino);
+
+	 if (!__has_curseg_space(sbi, type)) {
+	 sit_i->s_ops->allocate_segment(sbi, type, false);
+	 locate_dirty_segment(sbi, old_cursegno);
+	 old_cursegno = curseg->segno;
+	 }
+	 }
+	 locate_dirty_segment(sbi, old_cursegno);
+	 mutex_unlock(&sit_i->sentry_lock);
+
+	 for (i = start; i < nr && types[i] == types[start]; i++)
+	 submit_write_page(sbi, pages[i], blkaddrs[i],
+	 &curseg->io, DATA);
+
+	 mutex_unlock(&curseg->curseg_mutex);
+	}
+}
+
+void rewrite_data_page(struct f2fs_sb_info *sbi, struct page *page,
+	 block_t old_blk_addr)
+{
+	submit_write_page(sbi, page, old_blk_addr, &sbi->write_io[DATA], DATA);
+}
+
+/**
+ * Allocate consecutive blocks in one data log for up to count data indices
+ * of dn starting at dn->ofs_in_node. The old blocks stay valid, since the
+ * caller switches the dnode to the new blocks only after they are written.
+ * Direct writes issue their own bios, so no page is attached to the blocks.
+ * Returns the number of allocated blocks starting at *new_blkaddr, which is
+ * short of count when the log reaches the end of its segment or hits a used
+ * block in SSR mode.
+ */
+unsigned int allocate_data_blocks(struct f2fs_sb_info *sbi,
+	 struct dnode_of_data *dn, unsigned int count,
+	 block_t *new_blkaddr)
+{
+	struct sit_info *sit_i = SIT_I(sbi);
+	struct curseg_info *curseg;
+	struct f2fs_summary sum;
+	struct node_info ni;
+	unsigned int old_cursegno;
+	unsigned int i;
+	int type;
+
+	get_node_info(sbi, dn->nid, &ni);
+
+	type = __get_data_segment_type(dn->inode, NULL);
+	curseg = lock_curseg_head(sbi, &type);
+
+	*new_blkaddr = NEXT_FREE_BLKADDR(sbi, curseg);
+	old_cursegno = curseg->segno;
+
+	mutex_lock(&sit_i->sentry_lock);
+	for (i = 0; i < count; i++) {
+	 if (NEXT_FREE_BLKADDR(sbi, curseg) != *new_blkaddr + i)
+	 break;
+
+	 set_summary(&sum, dn->nid, dn->ofs_in_node + i, ni.version);
+	 __add_sum_entry(sbi, type, &sum, curseg->next_blkoff);
+	 __refresh_next_blkoff(sbi, curseg);
+	 sbi->block_count[curseg->alloc_type]++;
+
+	 refresh_sit_entry(sbi, NULL_ADDR, *new_blkaddr + i);
+	 __account_log_fill(sbi, type, dn->inode->i_ino);
+
+	 if (!__has_curseg_space(sbi, type)) {
+	 i++;
+	 break;
+	 }
+	}
+
+	if (!__has_curseg_space(sbi, type))
+	 sit_i->s_ops->allocate_segment(sbi, type, false);
+
+	locate_dirty_segment(sbi, old_cursegno);
+	mutex_unlock(&sit_i->sentry_lock);
+	mutex_unlock(&curseg->curseg_mutex);
+	return i;
+}
+
+static const char *ipu_policy_names[NR_IPU_POLICY] = {
+	[F2FS_IPU_NEVER]	= "never",
+	[F2FS_IPU_ALWAYS]	= "always",
+	[F2FS_IPU_UTIL]	 = "util",
+	[F2FS_IPU_FSYNC]	= "fsync",
+	[F2FS_IPU_SEQ]	 = "seq",
+};
 
-	do_write_page(sbi, page, old_blkaddr,
-	 new_blkaddr, &sum, DATA);
+int get_ipu_policy(const char *name)
+{
+	int i;
+	for (i = 0; i < NR_IPU_POLICY; i++)
+	 if (!strcmp(name, ipu_policy_names[i]))
+	 return i;
+	return -EINVAL;
 }
 
-void rewrite_data_page(struct f2fs_sb_info *sbi, struct page *page,
-	 block_t old_blk_addr)
+const char *ipu_policy_name(unsigned int policy)
 {
-	submit_write_page(sbi, page, old_blk_addr, DATA);
+	BUG_ON(policy >= NR_IPU_POLICY);
+	return ipu_policy_names[policy];
 }
 
 void recover_data_page(struct f2fs_sb_info *sbi,
@@ -939,7 +1663,7 @@ void rewrite_node_page(struct f2fs_sb_info *sbi,
 
 	/* rewrite node page */
 	set_page_writeback(page);
-	submit_write_page(sbi, page, new_blkaddr, NODE);
+	submit_write_page(sbi, page, new_blkaddr, &curseg->io, NODE);
 	f2fs_submit_bio(sbi, NODE, true);
 	refresh_sit_entry(sbi, old_blkaddr, new_blkaddr);
 
@@ -1165,12 +1889,32 @@ static void write_normal_summaries(struct f2fs_sb_info *sbi,
 	}
 }
 
+/**
+ * The checkpoint pack only has room for the default logs, so the summaries
+ * of private data logs are stored in their own SSA blocks. After a sudden
+ * power-off, their segments are treated as normal dirty segments.
+ */
+static void write_head_summaries(struct f2fs_sb_info *sbi)
+{
+	int i;
+
+	for (i = NR_CURSEG_TYPE; i < NR_CURSEGS(sbi); i++) {
+	 struct curseg_info *curseg = CURSEG_I(sbi, i);
+	 mutex_lock(&curseg->curseg_mutex);
+	 if (curseg->segno != NULL_SEGNO)
+	 write_sum_page(sbi, curseg->sum_blk,
+	 GET_SUM_BLOCK(sbi, curseg->segno));
+	 mutex_unlock(&curseg->curseg_mutex);
+	}
+}
+
 void write_data_summaries(struct f2fs_sb_info *sbi, block_t start_blk)
 {
 	if (sbi->ckpt->ckpt_flags & CP_COMPACT_SUM_FLAG)
 	 write_compacted_summaries(sbi, start_blk);
 	else
 	 write_normal_summaries(sbi, start_blk, CURSEG_HOT_DATA);
+	write_head_summaries(sbi);
 }
 
 void write_node_summaries(struct f2fs_sb_info *sbi, block_t start_blk)
@@ -1180,6 +1924,95 @@ void write_node_summaries(struct f2fs_sb_info *sbi, block_t start_blk)
 	return;
 }
 
+int npages_for_segmap_summary(struct f2fs_sb_info *sbi)
+{
+	return 1 + 2 * DIV_ROUND_UP(TOTAL_SEGS(sbi),
+	 F2FS_SEGMAP_BITS_PER_BLOCK);
+}
+
+static bool is_ckpt_curseg(struct f2fs_sb_info *sbi, unsigned int segno)
+{
+	int i;
+
+	for (i = 0; i < NR_CURSEG_TYPE; i++)
+	 if (CURSEG_I(sbi, i)->segno == segno)
+	 return true;
+	return false;
+}
+
+/**
+ * Segment maps are built from SIT entries in the same way as
+ * init_free_segmap() and init_dirty_segmap(), where only the current
+ * segments recorded in the checkpoint are in use.
+ */
+void write_segmap_summary(struct f2fs_sb_info *sbi, block_t start_blk)
+{
+	unsigned int nr_blks = DIV_ROUND_UP(TOTAL_SEGS(sbi),
+	 F2FS_SEGMAP_BITS_PER_BLOCK);
+	unsigned long long min_mtime = LLONG_MAX, max_mtime = 0, mtime = 0;
+	struct page *free_page = NULL, *dirty_page = NULL;
+	void *free_map = NULL, *dirty_map = NULL;
+	unsigned int segno, nr_free = 0, nr_dirty = 0;
+	struct f2fs_segmap_summary *ssum;
+	struct page *page;
+
+	for (segno = 0; segno < TOTAL_SEGS(sbi); segno++) {
+	 struct seg_entry *se = get_seg_entry(sbi, segno);
+	 unsigned int ofs = segno % F2FS_SEGMAP_BITS_PER_BLOCK;
+
+	 if (!ofs) {
+	 unsigned int blk = segno / F2FS_SEGMAP_BITS_PER_BLOCK;
+
+	 if (free_page) {
+	 set_page_dirty(free_page);
+	 f2fs_put_page(free_page, 1);
+	 set_page_dirty(dirty_page);
+	 f2fs_put_page(dirty_page, 1);
+	 }
+	 free_page = grab_meta_page(sbi, start_blk + 1 + blk);
+	 dirty_page = grab_meta_page(sbi,
+	 start_blk + 1 + nr_blks + blk);
+	 free_map = page_address(free_page);
+	 dirty_map = page_address(dirty_page);
+	 memset(free_map, 0, PAGE_CACHE_SIZE);
+	 memset(dirty_map, 0, PAGE_CACHE_SIZE);
+	 }
+
+	 mtime += se->mtime;
+	 if ((segno & (sbi->segs_per_sec - 1)) == sbi->segs_per_sec - 1) {
+	 mtime >>= sbi->log_segs_per_sec;
+	 min_mtime = min(min_mtime, mtime);
+	 max_mtime = max(max_mtime, mtime);
+	 mtime = 0;
+	 }
+
+	 if (is_ckpt_curseg(sbi, segno))
+	 continue;
+	 if (!se->valid_blocks) {
+	 __set_bit_le(ofs, free_map);
+	 nr_free++;
+	 } else if (se->valid_blocks < sbi->blocks_per_seg) {
+	 __set_bit_le(ofs, dirty_map);
+	 nr_dirty++;
+	 }
+	}
+	set_page_dirty(free_page);
+	f2fs_put_page(free_page, 1);
+	set_page_dirty(dirty_page);
+	f2fs_put_page(dirty_page, 1);
+
+	page = grab_meta_page(sbi, start_blk);
+	ssum = (struct f2fs_segmap_summary *)page_address(page);
+	memset(ssum, 0, PAGE_CACHE_SIZE);
+	ssum->segment_count = cpu_to_le32(TOTAL_SEGS(sbi));
+	ssum->free_segment_count = cpu_to_le32(nr_free);
+	ssum->dirty_segment_count = cpu_to_le32(nr_dirty);
+	ssum->min_mtime = cpu_to_le64(min_mtime);
+	ssum->max_mtime = cpu_to_le64(max_mtime);
+	set_page_dirty(page);
+	f2fs_put_page(page, 1);
+}
+
 int lookup_journal_in_cursum(struct f2fs_summary_block *sum, int type,
 	 unsigned int val, int alloc)
 {
@@ -1276,6 +2109,7 @@ static bool flush_sits_in_journal(struct f2fs_sb_info *sbi)
 void flush_sit_entries(struct f2fs_sb_info *sbi)
 {
 	struct sit_info *sit_i = SIT_I(sbi);
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
 	unsigned long *bitmap = sit_i->dirty_sentries_bitmap;
 	struct curseg_info *curseg = CURSEG_I(sbi, CURSEG_COLD_DATA);
 	struct f2fs_summary_block *sum = curseg->sum_blk;
@@ -1288,6 +2122,7 @@ void flush_sit_entries(struct f2fs_sb_info *sbi)
 
 	mutex_lock(&curseg->curseg_mutex);
 	mutex_lock(&sit_i->sentry_lock);
+	mutex_lock(&dirty_i->seglist_lock);
 
 	/*
 	 * "flushed" indicates whether sit entries in journal are flushed
@@ -1328,9 +2163,12 @@ to_sit_page:
 	 /* udpate entry in SIT block */
 	 seg_info_to_raw_sit(se, &raw_sit->entries[sit_offset]);
 flush_done:
+	 /* ckpt_valid_blocks is updated, which is used by SSR */
+	 __update_victim_entry(sbi, segno);
 	 __clear_bit(segno, bitmap);
 	 sit_i->dirty_sentries--;
 	}
+	mutex_unlock(&dirty_i->seglist_lock);
 	mutex_unlock(&sit_i->sentry_lock);
 	mutex_unlock(&curseg->curseg_mutex);
 
@@ -1433,6 +2271,12 @@ static int build_free_segmap(struct f2fs_sb_info *sbi)
 	if (!free_i->free_secmap)
 	 return -ENOMEM;
 
+	/* no free section until init_free_segmap */
+	free_i->free_secmap_sum = kzalloc(f2fs_bitmap_size(
+	 BITS_TO_LONGS(sbi->total_sections)), GFP_KERNEL);
+	if (!free_i->free_secmap_sum)
+	 return -ENOMEM;
+
 	/* set all segments as dirty temporarily */
 	memset(free_i->free_segmap, 0xff, bitmap_size);
 	memset(free_i->free_secmap, 0xff, sec_bitmap_size);
@@ -1446,19 +2290,42 @@ static int build_free_segmap(struct f2fs_sb_info *sbi)
 	return 0;
 }
 
+static int build_discard_info(struct f2fs_sb_info *sbi)
+{
+	struct discard_info *dis_i;
+
+	dis_i = kzalloc(sizeof(struct discard_info), GFP_KERNEL);
+	if (!dis_i)
+	 return -ENOMEM;
+
+	SM_I(sbi)->discard_info = dis_i;
+	mutex_init(&dis_i->discard_lock);
+	mutex_init(&dis_i->issue_lock);
+	init_waitqueue_head(&dis_i->issue_wait);
+	dis_i->root = RB_ROOT;
+	return 0;
+}
+
 static int build_curseg(struct f2fs_sb_info *sbi)
 {
+	struct f2fs_sm_info *sm_info = SM_I(sbi);
 	struct curseg_info *array = NULL;
 	int i;
 
-	array = kzalloc(sizeof(*array) * DEFAULT_CURSEGS, GFP_KERNEL);
+	/* private data logs are opened on demand after mount */
+	sm_info->nr_data_heads = sbi->mount_opt.data_heads;
+	sm_info->nr_cursegs = DEFAULT_CURSEGS +
+	 (sm_info->nr_data_heads - 1) * NR_CURSEG_DATA_TYPE;
+
+	array = kzalloc(sizeof(*array) * sm_info->nr_cursegs, GFP_KERNEL);
 	if (!array)
 	 return -ENOMEM;
 
-	SM_I(sbi)->curseg_array = array;
+	sm_info->curseg_array = array;
 
-	for (i = 0; i < DEFAULT_CURSEGS; i++) {
+	for (i = 0; i < sm_info->nr_cursegs; i++) {
 	 mutex_init(&array[i].curseg_mutex);
+	 mutex_init(&array[i].io.io_mutex);
 	 array[i].sum_blk = kzalloc(PAGE_CACHE_SIZE, GFP_KERNEL);
 	 if (!array[i].sum_blk)
 	 return -ENOMEM;
@@ -1468,48 +2335,280 @@ static int build_curseg(struct f2fs_sb_info *sbi)
 	return restore_curseg_summaries(sbi);
 }
 
-static void build_sit_entries(struct f2fs_sb_info *sbi)
+/**
+ * Issue reads for a range of SIT blocks without waiting for them,
+ * so that the following lookups find them in the meta page cache.
+ */
+static void ra_sit_pages(struct f2fs_sb_info *sbi, unsigned int start_blk,
+	 unsigned int end_blk)
 {
+	struct address_space *mapping = sbi->meta_inode->i_mapping;
 	struct sit_info *sit_i = SIT_I(sbi);
-	struct curseg_info *curseg = CURSEG_I(sbi, CURSEG_COLD_DATA);
-	struct f2fs_summary_block *sum = curseg->sum_blk;
-	unsigned int start;
+	struct blk_plug plug;
+	unsigned int blk;
 
-	for (start = 0; start < TOTAL_SEGS(sbi); start++) {
-	 struct seg_entry *se = &sit_i->sentries[start];
+	blk_start_plug(&plug);
+	for (blk = start_blk; blk < end_blk; blk++) {
+	 pgoff_t index = current_sit_addr(sbi,
+	 blk * sit_i->sents_per_block);
+	 struct page *page = grab_cache_page(mapping, index);
+
+	 if (!page)
+	 continue;
+	 /* the page is unlocked at the end of read */
+	 if (f2fs_readpage(sbi, page, index, READ))
+	 f2fs_put_page(page, 1);
+	 else
+	 f2fs_put_page(page, 0);
+	}
+	blk_finish_plug(&plug);
+}
+
+static void load_sit_blocks(struct f2fs_sb_info *sbi, unsigned int start_blk,
+	 unsigned int end_blk)
+{
+	struct sit_info *sit_i = SIT_I(sbi);
+	unsigned int blk;
+
+	for (blk = start_blk; blk < end_blk; blk++) {
+	 unsigned int start = blk * sit_i->sents_per_block;
+	 unsigned int end = min(start + sit_i->sents_per_block,
+	 TOTAL_SEGS(sbi));
 	 struct f2fs_sit_block *sit_blk;
-	 struct f2fs_sit_entry sit;
 	 struct page *page;
-	 int i;
+	 unsigned int segno;
+
+	 if ((blk - start_blk) % SIT_RA_BLOCKS == 0)
+	 ra_sit_pages(sbi, blk,
+	 min(blk + SIT_RA_BLOCKS, end_blk));
 
-	 mutex_lock(&curseg->curseg_mutex);
-	 for (i = 0; i < sits_in_cursum(sum); i++) {
-	 if (le32_to_cpu(segno_in_journal(sum, i)) == start) {
-	 sit = sit_in_journal(sum, i);
-	 mutex_unlock(&curseg->curseg_mutex);
-	 goto got_it;
-	 }
-	 }
-	 mutex_unlock(&curseg->curseg_mutex);
 	 page = get_current_sit_page(sbi, start);
 	 sit_blk = (struct f2fs_sit_block *)page_address(page);
-	 sit = sit_blk->entries[SIT_ENTRY_OFFSET(sit_i, start)];
+	 for (segno = start; segno < end; segno++) {
+	 struct f2fs_sit_entry *sit;
+
+	 sit = &sit_blk->entries[SIT_ENTRY_OFFSET(sit_i, segno)];
+	 check_block_count(sbi, segno, sit);
+	 seg_info_from_raw_sit(&sit_i->sentries[segno], sit);
+	 }
 	 f2fs_put_page(page, 1);
-got_it:
-	 check_block_count(sbi, start, &sit);
-	 seg_info_from_raw_sit(se, &sit);
+	}
+}
+
+static void sit_load_workfn(struct work_struct *work)
+{
+	struct sit_load_work *slw = container_of(work,
+	 struct sit_load_work, work);
+
+	load_sit_blocks(slw->sbi, slw->start_blk, slw->end_blk);
+}
+
+/**
+ * Call fn for each segment whose bit is set in a segment map of
+ * the segment map summary starting at blkaddr, and return the number of
+ * set bits, or -EINVAL as soon as fn rejects a segment.
+ */
+static int for_each_segmap_bit(struct f2fs_sb_info *sbi, block_t blkaddr,
+	 bool (*fn)(struct f2fs_sb_info *, unsigned int))
+{
+	unsigned int start;
+	int nr_bits = 0;
+
+	for (start = 0; start < TOTAL_SEGS(sbi);
+	 start += F2FS_SEGMAP_BITS_PER_BLOCK) {
+	 struct page *page = get_meta_page(sbi, blkaddr++);
+	 void *map = page_address(page);
+	 unsigned int nbits = min_t(unsigned int,
+	 F2FS_SEGMAP_BITS_PER_BLOCK, TOTAL_SEGS(sbi) - start);
+	 unsigned int ofs = find_next_bit_le(map, nbits, 0);
+
+	 while (ofs < nbits) {
+	 if (!fn(sbi, start + ofs)) {
+	 f2fs_put_page(page, 1);
+	 return -EINVAL;
+	 }
+	 nr_bits++;
+	 ofs = find_next_bit_le(map, nbits, ofs + 1);
+	 }
+	 f2fs_put_page(page, 1);
+	}
+	return nr_bits;
+}
+
+static bool __check_free(struct f2fs_sb_info *sbi, unsigned int segno)
+{
+	return !get_valid_blocks(sbi, segno, 0) && !is_ckpt_curseg(sbi, segno);
+}
+
+static bool __check_dirty(struct f2fs_sb_info *sbi, unsigned int segno)
+{
+	unsigned short valid_blocks = get_valid_blocks(sbi, segno, 0);
+
+	return valid_blocks && valid_blocks < sbi->blocks_per_seg &&
+	 !is_ckpt_curseg(sbi, segno);
+}
+
+/**
+ * The saved segment maps are trusted only if every segment in them agrees
+ * with the SIT entries just loaded, and their counts match the summary.
+ * Prefree segments became free after the checkpoint counted its free
+ * segments, so the checkpoint may count fewer of them, but never more.
+ * A segment missing from both maps would be taken as full and never be
+ * cleaned, so the rest of the segments should be full or current ones.
+ */
+static bool verify_segmap_summary(struct f2fs_sb_info *sbi,
+	 struct f2fs_segmap_summary *ssum)
+{
+	block_t blkaddr = segmap_summary_addr(sbi) + 1;
+	unsigned int segno, nr_others = 0;
+	int nr_free, nr_dirty;
+
+	nr_free = for_each_segmap_bit(sbi, blkaddr, __check_free);
+	if (nr_free < 0 || nr_free != le32_to_cpu(ssum->free_segment_count) ||
+	 nr_free < le32_to_cpu(F2FS_CKPT(sbi)->free_segment_count))
+	 return false;
+
+	blkaddr += DIV_ROUND_UP(TOTAL_SEGS(sbi), F2FS_SEGMAP_BITS_PER_BLOCK);
+	nr_dirty = for_each_segmap_bit(sbi, blkaddr, __check_dirty);
+	if (nr_dirty < 0 ||
+	 nr_dirty != le32_to_cpu(ssum->dirty_segment_count))
+	 return false;
+
+	for (segno = 0; segno < TOTAL_SEGS(sbi); segno++)
+	 if (get_valid_blocks(sbi, segno, 0) == sbi->blocks_per_seg ||
+	 is_ckpt_curseg(sbi, segno))
+	 nr_others++;
+	return nr_free + nr_dirty + nr_others == TOTAL_SEGS(sbi);
+}
+
+/**
+ * SIT blocks are split into ranges which are loaded by the mounting thread
+ * and unbound workqueue workers. Then, the SIT journal overrides them, and
+ * section entries are summed up from the loaded segment entries.
+ * If a segment map summary is given and agrees with the loaded entries,
+ * min and max mtime are taken from it, and true is returned.
+ */
+static bool build_sit_entries(struct f2fs_sb_info *sbi,
+	 struct f2fs_segmap_summary *ssum)
+{
+	struct sit_info *sit_i = SIT_I(sbi);
+	struct curseg_info *curseg = CURSEG_I(sbi, CURSEG_COLD_DATA);
+	struct f2fs_summary_block *sum = curseg->sum_blk;
+	unsigned int nr_blks = SIT_BLOCK_OFFSET(sit_i, TOTAL_SEGS(sbi) - 1) + 1;
+	unsigned int nr_works, blks_per_work, segno;
+	struct sit_load_work *works;
+	ktime_t start_time = ktime_get();
+	int i;
+
+	nr_works = min_t(unsigned int, num_online_cpus(), MAX_SIT_LOAD_WORKERS);
+	nr_works = min(nr_works, DIV_ROUND_UP(nr_blks, SIT_RA_BLOCKS));
+	blks_per_work = DIV_ROUND_UP(nr_blks, nr_works);
+
+	works = kcalloc(nr_works, sizeof(struct sit_load_work), GFP_KERNEL);
+	if (!works) {
+	 load_sit_blocks(sbi, 0, nr_blks);
+	 goto apply_journal;
+	}
+
+	for (i = 0; i < nr_works; i++) {
+	 works[i].sbi = sbi;
+	 works[i].start_blk = min(i * blks_per_work, nr_blks);
+	 works[i].end_blk = min((i + 1) * blks_per_work, nr_blks);
+	 INIT_WORK(&works[i].work, sit_load_workfn);
+	 if (i)
+	 queue_work(system_unbound_wq, &works[i].work);
+	}
+	load_sit_blocks(sbi, works[0].start_blk, works[0].end_blk);
+	for (i = 1; i < nr_works; i++)
+	 flush_work(&works[i].work);
+	kfree(works);
+
+apply_journal:
+	mutex_lock(&curseg->curseg_mutex);
+	for (i = 0; i < sits_in_cursum(sum); i++) {
+	 struct f2fs_sit_entry sit = sit_in_journal(sum, i);
+
+	 segno = le32_to_cpu(segno_in_journal(sum, i));
+	 check_block_count(sbi, segno, &sit);
+	 seg_info_from_raw_sit(get_seg_entry(sbi, segno), &sit);
+	}
+	mutex_unlock(&curseg->curseg_mutex);
+
+	if (ssum && !verify_segmap_summary(sbi, ssum))
+	 ssum = NULL;
+
+	/* min, max modified time for cost-benefit GC algorithm */
+	sit_i->min_mtime = LLONG_MAX;
+	sit_i->max_mtime = get_mtime(sbi);
+
+	if (ssum) {
+	 update_min_max_mtime(sit_i, le64_to_cpu(ssum->min_mtime));
+	 update_min_max_mtime(sit_i, le64_to_cpu(ssum->max_mtime));
+	 /* no section entry to be summed up */
+	 if (!sbi->log_segs_per_sec)
+	 goto out;
+	}
+
+	for (segno = 0; segno < TOTAL_SEGS(sbi); segno++) {
+	 struct seg_entry *se = get_seg_entry(sbi, segno);
+
 	 if (sbi->log_segs_per_sec) {
-	 struct sec_entry *e = get_sec_entry(sbi, start);
+	 struct sec_entry *e = get_sec_entry(sbi, segno);
 	 e->valid_blocks += se->valid_blocks;
+	 e->mtime += se->mtime;
 	 }
+
+	 /* the section mtime is complete at its last segment */
+	 if ((segno & (sbi->segs_per_sec - 1)) == sbi->segs_per_sec - 1)
+	 update_min_max_mtime(sit_i, get_sec_mtime(sbi, segno));
+	}
+out:
+	sbi->mount_time[MOUNT_SIT_ENTRIES] =
+	 ktime_us_delta(ktime_get(), start_time);
+	return ssum != NULL;
+}
+
+/**
+ * Return the header page of the segment map summary, if the last checkpoint
+ * was written at umount with it. This is also the case after a crash which
+ * follows such a checkpoint, as SIT blocks stay as they were until the next
+ * checkpoint and roll-forward recovery starts from them.
+ */
+static struct page *get_segmap_summary(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_segmap_summary *ssum;
+	struct page *page;
+
+	if (!(F2FS_CKPT(sbi)->ckpt_flags & CP_SEGMAP_FLAG))
+	 return NULL;
+
+	page = get_meta_page(sbi, segmap_summary_addr(sbi));
+	ssum = (struct f2fs_segmap_summary *)page_address(page);
+	if (le32_to_cpu(ssum->segment_count) != TOTAL_SEGS(sbi)) {
+	 f2fs_put_page(page, 1);
+	 return NULL;
 	}
+	return page;
+}
+
+static bool __load_free(struct f2fs_sb_info *sbi, unsigned int segno)
+{
+	__set_free(sbi, segno);
+	return true;
 }
 
-static void init_free_segmap(struct f2fs_sb_info *sbi)
+static void init_free_segmap(struct f2fs_sb_info *sbi, bool has_segmap)
 {
 	unsigned int start;
 	int type;
 
+	/* current segments are not in the free segment map */
+	if (has_segmap) {
+	 for_each_segmap_bit(sbi, segmap_summary_addr(sbi) + 1,
+	 __load_free);
+	 return;
+	}
+
 	for (start = 0; start < TOTAL_SEGS(sbi); start++) {
 	 struct seg_entry *sentry = get_seg_entry(sbi, start);
 	 if (!sentry->valid_blocks)
@@ -1523,13 +2622,29 @@ static void init_free_segmap(struct f2fs_sb_info *sbi)
 	}
 }
 
-static void init_dirty_segmap(struct f2fs_sb_info *sbi)
+static bool __set_dirty(struct f2fs_sb_info *sbi, unsigned int segno)
+{
+	__locate_dirty_segment(sbi, segno, DIRTY);
+	return true;
+}
+
+static void init_dirty_segmap(struct f2fs_sb_info *sbi, bool has_segmap)
 {
 	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
 	struct free_segmap_info *free_i = FREE_I(sbi);
 	unsigned int segno = 0, offset = 0;
 	unsigned short valid_blocks;
 
+	if (has_segmap) {
+	 block_t blkaddr = segmap_summary_addr(sbi) + 1 +
+	 DIV_ROUND_UP(TOTAL_SEGS(sbi), F2FS_SEGMAP_BITS_PER_BLOCK);
+
+	 mutex_lock(&dirty_i->seglist_lock);
+	 for_each_segmap_bit(sbi, blkaddr, __set_dirty);
+	 mutex_unlock(&dirty_i->seglist_lock);
+	 return;
+	}
+
 	while (segno < TOTAL_SEGS(sbi)) {
 	 /* find dirty segment based on free segmap */
 	 segno = find_next_inuse(free_i, TOTAL_SEGS(sbi), offset);
@@ -1557,7 +2672,52 @@ static int init_victim_segmap(struct f2fs_sb_info *sbi)
 	return 0;
 }
 
-static int build_dirty_segmap(struct f2fs_sb_info *sbi)
+static int init_victim_index(struct f2fs_sb_info *sbi,
+	 struct victim_index *vi)
+{
+	unsigned int i;
+
+	vi->buckets = kmalloc(sizeof(struct list_head) *
+	 NR_VICTIM_BUCKETS(sbi), GFP_KERNEL);
+	vi->bucket_map = kzalloc(f2fs_bitmap_size(NR_VICTIM_BUCKETS(sbi)),
+	 GFP_KERNEL);
+	if (!vi->buckets || !vi->bucket_map)
+	 return -ENOMEM;
+	for (i = 0; i < NR_VICTIM_BUCKETS(sbi); i++)
+	 INIT_LIST_HEAD(&vi->buckets[i]);
+	return 0;
+}
+
+static struct victim_entry *init_victim_entries(unsigned int count)
+{
+	struct victim_entry *entries;
+	unsigned int i;
+
+	entries = vzalloc(count * sizeof(struct victim_entry));
+	if (!entries)
+	 return NULL;
+	for (i = 0; i < count; i++)
+	 entries[i].bucket = NULL_BUCKET;
+	return entries;
+}
+
+static int build_victim_index(struct f2fs_sb_info *sbi)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	int i;
+
+	dirty_i->seg_ventries = init_victim_entries(TOTAL_SEGS(sbi));
+	dirty_i->sec_ventries = init_victim_entries(sbi->total_sections);
+	if (!dirty_i->seg_ventries || !dirty_i->sec_ventries)
+	 return -ENOMEM;
+
+	for (i = 0; i < NR_CURSEG_TYPE; i++)
+	 if (init_victim_index(sbi, &dirty_i->ssr_index[i]))
+	 return -ENOMEM;
+	return init_victim_index(sbi, &dirty_i->gc_index);
+}
+
+static int build_dirty_segmap(struct f2fs_sb_info *sbi, bool has_segmap)
 {
 	struct dirty_seglist_info *dirty_i;
 	unsigned int bitmap_size, i;
@@ -1579,36 +2739,11 @@ static int build_dirty_segmap(struct f2fs_sb_info *sbi)
 	 return -ENOMEM;
 	}
 
-	init_dirty_segmap(sbi);
-	return init_victim_segmap(sbi);
-}
-
-/**
- * Update min, max modified time for cost-benefit GC algorithm
- */
-static void init_min_max_mtime(struct f2fs_sb_info *sbi)
-{
-	struct sit_info *sit_i = SIT_I(sbi);
-	unsigned int segno;
-
-	mutex_lock(&sit_i->sentry_lock);
-
-	sit_i->min_mtime = LLONG_MAX;
-
-	for (segno = 0; segno < TOTAL_SEGS(sbi); segno += sbi->segs_per_sec) {
-	 unsigned int i;
-	 unsigned long long mtime = 0;
-
-	 for (i = 0; i < sbi->segs_per_sec; i++)
-	 mtime += get_seg_entry(sbi, segno + i)->mtime;
-
-	 mtime = mtime >> sbi->log_segs_per_sec;
+	if (build_victim_index(sbi))
+	 return -ENOMEM;
 
-	 if (sit_i->min_mtime > mtime)
-	 sit_i->min_mtime = mtime;
-	}
-	sit_i->max_mtime = get_mtime(sbi);
-	mutex_unlock(&sit_i->sentry_lock);
+	init_dirty_segmap(sbi, has_segmap);
+	return init_victim_segmap(sbi);
 }
 
 int build_segment_manager(struct f2fs_sb_info *sbi)
@@ -1616,6 +2751,9 @@ int build_segment_manager(struct f2fs_sb_info *sbi)
 	struct f2fs_super_block *raw_super = F2FS_RAW_SUPER(sbi);
 	struct f2fs_checkpoint *ckpt = F2FS_CKPT(sbi);
 	struct f2fs_sm_info *sm_info = NULL;
+	struct page *ssum_page;
+	bool has_segmap;
+	int err;
 
 	sm_info = kzalloc(sizeof(struct f2fs_sm_info), GFP_KERNEL);
 	if (!sm_info)
@@ -1640,17 +2778,29 @@ int build_segment_manager(struct f2fs_sb_info *sbi)
 	 return -EINVAL;
 	if (build_free_segmap(sbi))
 	 return -EINVAL;
+	if (build_discard_info(sbi))
+	 return -EINVAL;
 	if (build_curseg(sbi))
 	 return -EINVAL;
 
-	/* reinit free segmap based on SIT */
-	build_sit_entries(sbi);
+	/* the segment maps saved at umount let us skip the full scans */
+	ssum_page = get_segmap_summary(sbi);
+
+	/* reinit free segmap based on SIT, unless the saved maps agree */
+	has_segmap = build_sit_entries(sbi,
+	 ssum_page ? page_address(ssum_page) : NULL);
 
-	init_free_segmap(sbi);
-	if (build_dirty_segmap(sbi))
+	init_free_segmap(sbi, has_segmap);
+	err = build_dirty_segmap(sbi, has_segmap);
+	if (ssum_page)
+	 f2fs_put_page(ssum_page, 1);
+	if (err)
 	 return -EINVAL;
 
-	init_min_max_mtime(sbi);
+	sm_info->bio_set = bioset_create(F2FS_BIO_POOL_SIZE(sbi),
+	 offsetof(struct bio_private, bio));
+	if (!sm_info->bio_set)
+	 return -ENOMEM;
 	return 0;
 }
 
@@ -1679,6 +2829,21 @@ static void destroy_victim_segmap(struct f2fs_sb_info *sbi)
 	kfree(dirty_i->victim_segmap[BG_GC]);
 }
 
+static void destroy_victim_index(struct f2fs_sb_info *sbi)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	int i;
+
+	for (i = 0; i < NR_CURSEG_TYPE; i++) {
+	 kfree(dirty_i->ssr_index[i].buckets);
+	 kfree(dirty_i->ssr_index[i].bucket_map);
+	}
+	kfree(dirty_i->gc_index.buckets);
+	kfree(dirty_i->gc_index.bucket_map);
+	vfree(dirty_i->seg_ventries);
+	vfree(dirty_i->sec_ventries);
+}
+
 static void destroy_dirty_segmap(struct f2fs_sb_info *sbi)
 {
 	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
@@ -1692,6 +2857,7 @@ static void destroy_dirty_segmap(struct f2fs_sb_info *sbi)
 	 discard_dirty_segmap(sbi, i);
 
 	destroy_victim_segmap(sbi);
+	destroy_victim_index(sbi);
 	SM_I(sbi)->dirty_info = NULL;
 	kfree(dirty_i);
 }
@@ -1703,9 +2869,9 @@ static void destroy_curseg(struct f2fs_sb_info *sbi)
 
 	if (!array)
 	 return;
-	SM_I(sbi)->curseg_array = NULL;
-	for (i = 0; i < DEFAULT_CURSEGS; i++)
+	for (i = 0; i < NR_CURSEGS(sbi); i++)
 	 kfree(array[i].sum_blk);
+	SM_I(sbi)->curseg_array = NULL;
 	kfree(array);
 }
 
@@ -1717,6 +2883,7 @@ static void destroy_free_segmap(struct f2fs_sb_info *sbi)
 	SM_I(sbi)->free_info = NULL;
 	kfree(free_i->free_segmap);
 	kfree(free_i->free_secmap);
+	kfree(free_i->free_secmap_sum);
 	kfree(free_i);
 }
 
@@ -1743,13 +2910,46 @@ static void destroy_sit_info(struct f2fs_sb_info *sbi)
 	kfree(sit_i);
 }
 
+static void destroy_discard_info(struct f2fs_sb_info *sbi)
+{
+	struct discard_info *dis_i = DISCARD_I(sbi);
+	struct rb_node *node;
+
+	if (!dis_i)
+	 return;
+
+	/* remaining extents are just not discarded */
+	while ((node = rb_first(&dis_i->root)))
+	 __free_discard_entry(dis_i,
+	 rb_entry(node, struct discard_entry, rb_node));
+	SM_I(sbi)->discard_info = NULL;
+	kfree(dis_i);
+}
+
 void destroy_segment_manager(struct f2fs_sb_info *sbi)
 {
 	struct f2fs_sm_info *sm_info = SM_I(sbi);
+	if (sm_info->bio_set)
+	 bioset_free(sm_info->bio_set);
 	destroy_dirty_segmap(sbi);
 	destroy_curseg(sbi);
+	destroy_discard_info(sbi);
 	destroy_free_segmap(sbi);
 	destroy_sit_info(sbi);
 	sbi->sm_info = NULL;
 	kfree(sm_info);
 }
+
+int create_segment_manager_caches(void)
+{
+	discard_entry_slab = f2fs_kmem_cache_create("f2fs_discard_entry",
+	 sizeof(struct discard_entry), NULL);
+	if (!discard_entry_slab)
+	 return -ENOMEM;
+	return 0;
+}
+
+void destroy_segment_manager_caches(void)
+{
+	kmem_cache_destroy(discard_entry_slab);
+}
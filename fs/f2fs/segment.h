@@ -10,6 +10,7 @@
  */
 /* constant macro */
 #define DEFAULT_CURSEGS	 (6)
+#define NR_CURSEGS(sbi)	 (SM_I(sbi)->nr_cursegs)
 #define NULL_SEGNO	 ((unsigned int)(~0))
 #define SUM_TYPE_NODE	 (1)
 #define SUM_TYPE_DATA	 (0)
@@ -27,26 +28,10 @@
 	(t == CURSEG_WARM_NODE))
 
 #define IS_CURSEG(sbi, segno)	 \
-	((segno == CURSEG_I(sbi, CURSEG_HOT_DATA)->segno) ||	\
-	 (segno == CURSEG_I(sbi, CURSEG_WARM_DATA)->segno) ||	\
-	 (segno == CURSEG_I(sbi, CURSEG_COLD_DATA)->segno) ||	\
-	 (segno == CURSEG_I(sbi, CURSEG_HOT_NODE)->segno) ||	\
-	 (segno == CURSEG_I(sbi, CURSEG_WARM_NODE)->segno) ||	\
-	 (segno == CURSEG_I(sbi, CURSEG_COLD_NODE)->segno))
+	(__is_cur_log(sbi, segno, 0))
 
 #define IS_CURSEC(sbi, secno)	 \
-	((secno == CURSEG_I(sbi, CURSEG_HOT_DATA)->segno >>	 \
-	 sbi->log_segs_per_sec) ||	\
-	 (secno == CURSEG_I(sbi, CURSEG_WARM_DATA)->segno >>	 \
-	 sbi->log_segs_per_sec) ||	\
-	 (secno == CURSEG_I(sbi, CURSEG_COLD_DATA)->segno >>	 \
-	 sbi->log_segs_per_sec) ||	\
-	 (secno == CURSEG_I(sbi, CURSEG_HOT_NODE)->segno >>	 \
-	 sbi->log_segs_per_sec) ||	\
-	 (secno == CURSEG_I(sbi, CURSEG_WARM_NODE)->segno >>	 \
-	 sbi->log_segs_per_sec) ||	\
-	 (secno == CURSEG_I(sbi, CURSEG_COLD_NODE)->segno >>	 \
-	 sbi->log_segs_per_sec))	\
+	(__is_cur_log(sbi, secno, sbi->log_segs_per_sec))
 
 #define START_BLOCK(sbi, segno)	 \
 	(SM_I(sbi)->seg0_blkaddr +	 \
@@ -112,12 +97,31 @@ enum {
 #define GET_SIT_TYPE(raw_sit)	 \
 	((le16_to_cpu((raw_sit)->vblocks) & ~VBLOCKS_MASK) >> 10)
 
+/**
+ * The completion context is embedded in front of every f2fs write bio by
+ * the front_pad of the bio_set, so that it is never allocated separately.
+ */
 struct bio_private {
 	struct f2fs_sb_info *sbi;
 	bool is_sync;
 	void *wait;
+	int io_class;
+	u64 submit_us;	 /* submission time in usecs */
+	struct bio bio;	 /* should be the last member */
 };
 
+#define F2FS_BIO_PRIVATE(bio)	container_of(bio, struct bio_private, bio)
+
+/*
+ * The reserved write bios should outnumber the ones that the bio builders
+ * of a partition, i.e., its logs and write_io[], keep under assembly, or the
+ * writers could wait for bios which are never submitted.
+ */
+#define F2FS_BIO_POOL_SIZE(sbi)	(NR_CURSEGS(sbi) + NR_PAGE_TYPE + 1)
+
+/* Max. number of dirty data pages written back under one dnode lookup */
+#define WRITE_BATCH_PAGES	32
+
 enum {
 	GC_CB = 0,
 	GC_GREEDY
@@ -145,6 +149,18 @@ struct seg_entry {
 
 struct sec_entry {
 	unsigned int valid_blocks;
+	unsigned long long mtime;	/* sum of mtimes of its segments */
+};
+
+/* for loading SIT entries at mount time */
+#define SIT_RA_BLOCKS	 64	/* # of SIT blocks read ahead at once */
+#define MAX_SIT_LOAD_WORKERS	8
+
+struct sit_load_work {
+	struct work_struct work;
+	struct f2fs_sb_info *sbi;
+	unsigned int start_blk;	 /* first SIT block to load */
+	unsigned int end_blk;	 /* last SIT block to load + 1 */
 };
 
 struct segment_allocation {
@@ -171,8 +187,8 @@ struct sit_info {
 
 	unsigned long long elapsed_time;
 	unsigned long long mounted_time;
-	unsigned long long min_mtime;
-	unsigned long long max_mtime;
+	unsigned long long min_mtime;	/* min. section mtime */
+	unsigned long long max_mtime;	/* max. section mtime */
 };
 
 struct free_segmap_info {
@@ -182,6 +198,8 @@ struct free_segmap_info {
 	rwlock_t segmap_lock;	 /* free segmap lock */
 	unsigned long *free_segmap;
 	unsigned long *free_secmap;
+	unsigned long *free_secmap_sum;	/* a bit per free_secmap word,
+	 set if the word has free sections */
 };
 
 /* Notice: The order of dirty type is same with CURSEG_XXX in f2fs.h */
@@ -202,26 +220,74 @@ enum {
 	FG_GC
 };
 
+/**
+ * Dirty segments and sections are bucketed by their valid blocks, so that
+ * greedy GC and SSR find the global minimum without scanning dirty segmaps.
+ * The bucket of a section is its valid blocks divided by segs_per_sec.
+ */
+#define NR_VICTIM_BUCKETS(sbi)	((sbi)->blocks_per_seg + 1)
+#define NULL_BUCKET	 ((unsigned int)(~0))
+
+struct victim_entry {
+	struct list_head list;	 /* linked to a bucket */
+	unsigned int bucket;	 /* bucket index or NULL_BUCKET */
+	unsigned int nr_dirty;	 /* # of dirty segments in a section */
+};
+
+struct victim_index {
+	struct list_head *buckets;	/* victim entries per bucket */
+	unsigned long *bucket_map;	/* bitmap of non-empty buckets */
+};
+
 struct dirty_seglist_info {
 	const struct victim_selection *v_ops;
 	struct mutex seglist_lock;
 	unsigned long *dirty_segmap[NR_DIRTY_TYPE];
 	int nr_dirty[NR_DIRTY_TYPE];
 	unsigned long *victim_segmap[2];	/* BG_GC, FG_GC */
+	struct victim_entry *seg_ventries;	/* per segment, for SSR */
+	struct victim_entry *sec_ventries;	/* per section, for GC */
+	struct victim_index ssr_index[NR_CURSEG_TYPE];	/* by ckpt vblocks */
+	struct victim_index gc_index;	 /* by valid blocks */
 };
 
 struct victim_selection {
 	int (*get_victim)(struct f2fs_sb_info *, unsigned int *, int, int);
 };
 
+/* for asynchronous discard */
+struct discard_entry {
+	struct rb_node rb_node;	 /* linked to the discard tree */
+	block_t start;	 /* start block address */
+	block_t len;	 /* # of blocks */
+};
+
+struct discard_info {
+	struct mutex discard_lock;	/* to protect the below fields */
+	struct rb_root root;	 /* pending extents sorted by address */
+	unsigned int nr_extents;	/* # of pending extents */
+	block_t pending_blocks;	 /* # of blocks in pending extents */
+	block_t issue_start;	 /* start of the extent being issued */
+	block_t issue_len;	 /* # of blocks being issued */
+	wait_queue_head_t issue_wait;	/* to wait for the issued extent */
+	struct mutex issue_lock;	/* to serialize discard issuers */
+	struct task_struct *discard_task;	/* background issuing thread */
+	unsigned long long queued_blocks;	/* total # of queued blocks */
+	unsigned long long issued_blocks;	/* total # of discarded blocks */
+	unsigned long long issued_cmds;	 /* total # of discard commands */
+};
+
 struct curseg_info {
 	struct mutex curseg_mutex;
+	struct f2fs_bio_info io;	/* bio for the writes to this log */
 	struct f2fs_summary_block *sum_blk;
 	unsigned char alloc_type;
 	unsigned int segno;
 	unsigned short next_blkoff;
 	unsigned int zone;
 	unsigned int next_segno;
+	nid_t last_ino;	 /* owner of the last written block */
+	unsigned int nr_runs;	 /* # of file runs in this segment */
 };
 
 /**
@@ -232,6 +298,31 @@ static inline struct curseg_info *CURSEG_I(struct f2fs_sb_info *sbi, int type)
 	return (struct curseg_info *)(SM_I(sbi)->curseg_array + type);
 }
 
+/**
+ * With multi-head logging, each cpu group owns private data logs which are
+ * placed after the default logs in curseg_array as [HOT|WARM|COLD]_DATA.
+ * This returns the log temperature, i.e. CURSEG_XXX, of a given entry.
+ */
+static inline int curseg_log_type(int type)
+{
+	if (type < NR_CURSEG_TYPE)
+	 return type;
+	return (type - NR_CURSEG_TYPE) % NR_CURSEG_DATA_TYPE;
+}
+
+static inline bool __is_cur_log(struct f2fs_sb_info *sbi,
+	 unsigned int no, unsigned int shift)
+{
+	int i;
+
+	for (i = 0; i < NR_CURSEGS(sbi); i++) {
+	 unsigned int segno = CURSEG_I(sbi, i)->segno;
+	 if (segno != NULL_SEGNO && no == (segno >> shift))
+	 return true;
+	}
+	return false;
+}
+
 static inline struct seg_entry *get_seg_entry(struct f2fs_sb_info *sbi,
 	 unsigned int segno)
 {
@@ -255,6 +346,28 @@ static inline unsigned int get_valid_blocks(struct f2fs_sb_info *sbi,
 	 return get_seg_entry(sbi, segno)->valid_blocks;
 }
 
+/**
+ * Section mtime is the average of the mtimes of its segments
+ */
+static inline unsigned long long get_sec_mtime(struct f2fs_sb_info *sbi,
+	 unsigned int segno)
+{
+	if (sbi->log_segs_per_sec)
+	 return get_sec_entry(sbi, segno)->mtime >> sbi->log_segs_per_sec;
+	else
+	 return get_seg_entry(sbi, segno)->mtime;
+}
+
+static inline void update_min_max_mtime(struct sit_info *sit_i,
+	 unsigned long long mtime)
+{
+	/* Handle if the system time is changed by user */
+	if (mtime < sit_i->min_mtime)
+	 sit_i->min_mtime = mtime;
+	if (mtime > sit_i->max_mtime)
+	 sit_i->max_mtime = mtime;
+}
+
 static inline void seg_info_from_raw_sit(struct seg_entry *se,
 	 struct f2fs_sit_entry *rs)
 {
@@ -287,20 +400,38 @@ static inline unsigned int find_next_inuse(struct free_segmap_info *free_i,
 	return ret;
 }
 
+/**
+ * Keep the summary bit of free_secmap word including secno in sync,
+ * so that free sections can be found without walking fully used words.
+ * This should be called under segmap_lock after changing free_secmap.
+ */
+static inline void __update_secmap_sum(struct free_segmap_info *free_i,
+	 unsigned int secno)
+{
+	unsigned int word = BIT_WORD(secno);
+
+	if (~free_i->free_secmap[word])
+	 set_bit(word, free_i->free_secmap_sum);
+	else
+	 clear_bit(word, free_i->free_secmap_sum);
+}
+
 static inline void __set_free(struct f2fs_sb_info *sbi, unsigned int segno)
 {
 	struct free_segmap_info *free_i = FREE_I(sbi);
 	unsigned int secno = segno >> sbi->log_segs_per_sec;
 	unsigned int start_segno = secno << sbi->log_segs_per_sec;
+	unsigned int end_segno = start_segno + sbi->segs_per_sec;
 	unsigned int next;
 
 	write_lock(&free_i->segmap_lock);
 	clear_bit(segno, free_i->free_segmap);
 	free_i->free_segments++;
 
-	next = find_next_bit(free_i->free_segmap, TOTAL_SEGS(sbi), start_segno);
-	if (next >= start_segno + sbi->segs_per_sec) {
+	next = find_next_bit(free_i->free_segmap, end_segno, start_segno);
+	if (next >= end_segno) {
 	 clear_bit(secno, free_i->free_secmap);
+	 __update_secmap_sum(free_i, secno);
 	 free_i->free_sections++;
 	}
 	write_unlock(&free_i->segmap_lock);
@@ -313,8 +444,10 @@ static inline void __set_inuse(struct f2fs_sb_info *sbi,
 	unsigned int secno = segno >> sbi->log_segs_per_sec;
 	set_bit(segno, free_i->free_segmap);
 	free_i->free_segments--;
-	if (!test_and_set_bit(secno, free_i->free_secmap))
+	if (!test_and_set_bit(secno, free_i->free_secmap)) {
+	 __update_secmap_sum(free_i, secno);
 	 free_i->free_sections--;
+	}
 }
 
 static inline void __set_test_and_free(struct f2fs_sb_info *sbi,
@@ -323,18 +456,21 @@ static inline void __set_test_and_free(struct f2fs_sb_info *sbi,
 	struct free_segmap_info *free_i = FREE_I(sbi);
 	unsigned int secno = segno >> sbi->log_segs_per_sec;
 	unsigned int start_segno = secno << sbi->log_segs_per_sec;
+	unsigned int end_segno = start_segno + sbi->segs_per_sec;
 	unsigned int next;
 
 	write_lock(&free_i->segmap_lock);
 	if (test_and_clear_bit(segno, free_i->free_segmap)) {
 	 free_i->free_segments++;
 
-	 next = find_next_bit(free_i->free_segmap, TOTAL_SEGS(sbi),
+	 next = find_next_bit(free_i->free_segmap, end_segno,
 	 start_segno);
-	 if (next >= start_segno + sbi->segs_per_sec) {
-	 if (test_and_clear_bit(secno, free_i->free_secmap))
+	 if (next >= end_segno) {
+	 if (test_and_clear_bit(secno, free_i->free_secmap)) {
+	 __update_secmap_sum(free_i, secno);
 	 free_i->free_sections++;
 	 }
+	 }
 	}
 	write_unlock(&free_i->segmap_lock);
 }
@@ -347,8 +483,10 @@ static inline void __set_test_and_inuse(struct f2fs_sb_info *sbi,
 	write_lock(&free_i->segmap_lock);
 	if (!test_and_set_bit(segno, free_i->free_segmap)) {
 	 free_i->free_segments--;
-	 if (!test_and_set_bit(secno, free_i->free_secmap))
+	 if (!test_and_set_bit(secno, free_i->free_secmap)) {
+	 __update_secmap_sum(free_i, secno);
 	 free_i->free_sections--;
+	 }
 	}
 	write_unlock(&free_i->segmap_lock);
 }
@@ -453,15 +591,79 @@ static inline int utilization(struct f2fs_sb_info *sbi)
 	 (long int)sbi->user_block_count;
 }
 
-/* Disable In-Place-Update by default */
-#define MIN_IPU_UTIL	 100
-static inline bool need_inplace_update(struct inode *inode)
+/**
+ * The write temperature of a file is classified by the average interval of
+ * its data overwrites. Overwrites closer than TEMP_UPDATE_GRAN belong to
+ * the same update, since writeback flushes a file's dirty pages together.
+ */
+#define TEMP_UPDATE_GRAN	HZ
+#define HOT_UPDATE_INTERVAL	(60 * HZ)
+#define COLD_UPDATE_INTERVAL	(3600 * HZ)
+
+static inline void update_write_temp(struct inode *inode)
+{
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+	unsigned long now = jiffies;
+	unsigned long interval = now - fi->last_update;
+
+	if (!fi->last_update) {
+	 fi->last_update = now;
+	 return;
+	}
+	if (interval < TEMP_UPDATE_GRAN)
+	 return;
+
+	if (fi->update_interval)
+	 fi->update_interval = (fi->update_interval * 7 + interval) / 8;
+	else
+	 fi->update_interval = interval;
+	fi->last_update = now;
+}
+
+/**
+ * A file that has not been updated for a while cools down even though
+ * it used to be hot, so the age since the last update is also considered.
+ */
+static inline int get_write_temp(struct inode *inode)
+{
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+	unsigned long interval;
+
+	if (!fi->update_interval)
+	 return CURSEG_WARM_DATA;
+
+	interval = max(fi->update_interval, jiffies - fi->last_update);
+	if (interval < HOT_UPDATE_INTERVAL)
+	 return CURSEG_HOT_DATA;
+	if (interval > COLD_UPDATE_INTERVAL)
+	 return CURSEG_COLD_DATA;
+	return CURSEG_WARM_DATA;
+}
+
+/**
+ * Decide whether the updated data page should be rewritten in place
+ * according to the current IPU policy.
+ */
+static inline bool need_inplace_update(struct inode *inode, struct page *page)
 {
 	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+
 	if (S_ISDIR(inode->i_mode))
 	 return false;
-	if (need_SSR(sbi) && utilization(sbi) > MIN_IPU_UTIL)
+
+	switch (sbi->mount_opt.ipu_policy) {
+	case F2FS_IPU_ALWAYS:
 	 return true;
+	case F2FS_IPU_UTIL:
+	 return need_SSR(sbi) &&
+	 utilization(sbi) > sbi->mount_opt.min_ipu_util;
+	case F2FS_IPU_FSYNC:
+	 return fi->fsync_task == current;
+	case F2FS_IPU_SEQ:
+	 return fi->last_write_index != NULL_WRITE_INDEX &&
+	 page->index == fi->last_write_index + 1;
+	}
 	return false;
 }
 
@@ -619,6 +821,11 @@ static inline block_t start_sum_block(struct f2fs_sb_info *sbi)
 	 le32_to_cpu(F2FS_CKPT(sbi)->cp_pack_start_sum);
 }
 
+static inline block_t segmap_summary_addr(struct f2fs_sb_info *sbi)
+{
+	return start_sum_block(sbi) - npages_for_segmap_summary(sbi);
+}
+
 static inline block_t sum_blk_addr(struct f2fs_sb_info *sbi, int base, int type)
 {
 	return __start_cp_addr(sbi) +
@@ -19,6 +19,7 @@
 #include <linux/parser.h>
 #include <linux/mount.h>
 #include <linux/seq_file.h>
+#include <linux/ktime.h>
 #include <linux/f2fs_fs.h>
 
 #include "f2fs.h"
@@ -35,6 +36,11 @@ enum {
 	Opt_noheap,
 	Opt_nouser_xattr,
 	Opt_noacl,
+	Opt_data_heads,
+	Opt_ipu_policy,
+	Opt_min_ipu_util,
+	Opt_gc_max_kbps,
+	Opt_max_extents,
 	Opt_err,
 };
 
@@ -45,6 +51,11 @@ static match_table_t f2fs_tokens = {
 	{Opt_noheap, "no_heap"},
 	{Opt_nouser_xattr, "nouser_xattr"},
 	{Opt_noacl, "noacl"},
+	{Opt_data_heads, "data_heads=%u"},
+	{Opt_ipu_policy, "ipu_policy=%s"},
+	{Opt_min_ipu_util, "min_ipu_util=%u"},
+	{Opt_gc_max_kbps, "gc_max_kbps=%u"},
+	{Opt_max_extents, "max_extents=%u"},
 	{Opt_err, NULL},
 };
 
@@ -70,8 +81,13 @@ static struct inode *f2fs_alloc_inode(struct super_block *sb)
 	fi->vfs_inode.i_version = 1;
 	atomic_set(&fi->dirty_dents, 0);
 	fi->current_depth = 1;
-	fi->is_cold = 0;
-	rwlock_init(&fi->ext.ext_lock);
+	fi->i_advise = 0;
+	fi->last_write_index = NULL_WRITE_INDEX;
+	rwlock_init(&fi->ext.lock);
+	fi->ext.root = RB_ROOT;
+	init_rwsem(&fi->dio_rwsem);
+	mutex_init(&fi->writepages);
+	INIT_LIST_HEAD(&fi->dio_list);
 
 	set_inode_flag(fi, FI_NEW_INODE);
 
@@ -93,6 +109,8 @@ static void f2fs_put_super(struct super_block *sb)
 {
 	struct f2fs_sb_info *sbi = F2FS_SB(sb);
 
+	unregister_shrinker(&sbi->extent_shrinker);
+
 #ifdef CONFIG_F2FS_STAT_FS
 	if (sbi->s_proc) {
 	 f2fs_stat_exit(sbi);
@@ -100,9 +118,14 @@ static void f2fs_put_super(struct super_block *sb)
 	}
 #endif
 	stop_gc_thread(sbi);
+	stop_discard_thread(sbi);
 
 	write_checkpoint(sbi, false, true);
 
+	/* issue the discards queued so far */
+	if (test_opt(sbi, DISCARD))
+	 flush_discard_extents(sbi);
+
 	iput(sbi->node_inode);
 	iput(sbi->meta_inode);
 
@@ -184,6 +207,18 @@ static int f2fs_show_options(struct seq_file *seq, struct dentry *root)
 	else
 	 seq_puts(seq, ",noacl");
 #endif
+	if (sbi->mount_opt.data_heads > 1)
+	 seq_printf(seq, ",data_heads=%u", sbi->mount_opt.data_heads);
+	if (sbi->mount_opt.ipu_policy != DEF_IPU_POLICY)
+	 seq_printf(seq, ",ipu_policy=%s",
+	 ipu_policy_name(sbi->mount_opt.ipu_policy));
+	if (sbi->mount_opt.ipu_policy == F2FS_IPU_UTIL)
+	 seq_printf(seq, ",min_ipu_util=%u",
+	 sbi->mount_opt.min_ipu_util);
+	if (sbi->mount_opt.gc_max_kbps)
+	 seq_printf(seq, ",gc_max_kbps=%u", sbi->mount_opt.gc_max_kbps);
+	if (sbi->mount_opt.max_extents != DEF_MAX_EXTENTS)
+	 seq_printf(seq, ",max_extents=%u", sbi->mount_opt.max_extents);
 	return 0;
 }
 
@@ -201,7 +236,8 @@ static struct super_operations f2fs_sops = {
 static int parse_options(struct f2fs_sb_info *sbi, char *options)
 {
 	substring_t args[MAX_OPT_ARGS];
-	char *p;
+	char *p, *name;
+	int arg = 0;
 
 	if (!options)
 	 return 0;
@@ -242,6 +278,44 @@ static int parse_options(struct f2fs_sb_info *sbi, char *options)
 	 pr_info("noacl options not supported\n");
 	 break;
 #endif
+	 case Opt_data_heads:
+	 if (match_int(args, &arg))
+	 return -EINVAL;
+	 if (arg < 1 || arg > MAX_DATA_HEADS)
+	 return -EINVAL;
+	 sbi->mount_opt.data_heads = arg;
+	 break;
+	 case Opt_ipu_policy:
+	 name = match_strdup(args);
+	 if (!name)
+	 return -ENOMEM;
+	 arg = get_ipu_policy(name);
+	 kfree(name);
+	 if (arg < 0)
+	 return -EINVAL;
+	 sbi->mount_opt.ipu_policy = arg;
+	 break;
+	 case Opt_min_ipu_util:
+	 if (match_int(args, &arg))
+	 return -EINVAL;
+	 if (arg < 0 || arg > 100)
+	 return -EINVAL;
+	 sbi->mount_opt.min_ipu_util = arg;
+	 break;
+	 case Opt_gc_max_kbps:
+	 if (match_int(args, &arg))
+	 return -EINVAL;
+	 if (arg < 0)
+	 return -EINVAL;
+	 sbi->mount_opt.gc_max_kbps = arg;
+	 break;
+	 case Opt_max_extents:
+	 if (match_int(args, &arg))
+	 return -EINVAL;
+	 if (arg < 0)
+	 return -EINVAL;
+	 sbi->mount_opt.max_extents = arg;
+	 break;
 	 default:
 	 return -EINVAL;
 	 }
@@ -328,6 +402,7 @@ static int f2fs_fill_super(struct super_block *sb, void *data, int silent)
 	struct f2fs_super_block *raw_super;
 	struct buffer_head *raw_super_buf;
 	struct inode *root;
+	ktime_t mount_start = ktime_get(), start;
 	int i;
 
 	/* allocate memory for f2fs-specific super block info */
@@ -347,6 +422,10 @@ static int f2fs_fill_super(struct super_block *sb, void *data, int silent)
 
 	/* init some FS parameters */
 	set_opt(sbi, BG_GC);
+	sbi->mount_opt.data_heads = 1;
+	sbi->mount_opt.ipu_policy = DEF_IPU_POLICY;
+	sbi->mount_opt.min_ipu_util = DEF_MIN_IPU_UTIL;
+	sbi->mount_opt.max_extents = DEF_MAX_EXTENTS;
 
 #ifdef CONFIG_F2FS_FS_XATTR
 	set_opt(sbi, XATTR_USER);
@@ -376,13 +455,15 @@ static int f2fs_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->raw_super_buf = raw_super_buf;
 	mutex_init(&sbi->gc_mutex);
 	mutex_init(&sbi->write_inode);
-	mutex_init(&sbi->writepages);
 	mutex_init(&sbi->cp_mutex);
+	init_rwsem(&sbi->dio_sem);
 	for (i = 0; i < NR_LOCK_TYPE; i++)
 	 mutex_init(&sbi->fs_lock[i]);
 	sbi->por_doing = 0;
 	spin_lock_init(&sbi->stat_lock);
-	init_rwsem(&sbi->bio_sem);
+	init_extent_cache_info(sbi);
+	for (i = 0; i < NR_PAGE_TYPE; i++)
+	 mutex_init(&sbi->write_io[i].io_mutex);
 	init_sb_info(sbi);
 
 	/* get an inode for meta space */
@@ -390,8 +471,10 @@ static int f2fs_fill_super(struct super_block *sb, void *data, int silent)
 	if (IS_ERR(sbi->meta_inode))
 	 goto free_sb_buf;
 
+	start = ktime_get();
 	if (get_valid_checkpoint(sbi))
 	 goto free_meta_inode;
+	sbi->mount_time[MOUNT_CHECKPOINT] = ktime_us_delta(ktime_get(), start);
 
 	/* sanity checking of checkpoint */
 	if (sanity_check_ckpt(raw_super, sbi->ckpt))
@@ -416,10 +499,16 @@ static int f2fs_fill_super(struct super_block *sb, void *data, int silent)
 	init_orphan_info(sbi);
 
 	/* setup f2fs internal modules */
+	start = ktime_get();
 	if (build_segment_manager(sbi))
 	 goto free_sm;
+	sbi->mount_time[MOUNT_SEGMENT_MANAGER] =
+	 ktime_us_delta(ktime_get(), start);
+	start = ktime_get();
 	if (build_node_manager(sbi))
 	 goto free_nm;
+	sbi->mount_time[MOUNT_NODE_MANAGER] =
+	 ktime_us_delta(ktime_get(), start);
 	if (build_gc_manager(sbi))
 	 goto free_gc;
 
@@ -444,12 +533,19 @@ static int f2fs_fill_super(struct super_block *sb, void *data, int silent)
 	 goto free_root_inode;
 
 	/* recover fsynced data */
+	start = ktime_get();
 	if (!test_opt(sbi, DISABLE_ROLL_FORWARD))
 	 recover_fsync_data(sbi);
+	sbi->mount_time[MOUNT_ROLL_FORWARD] =
+	 ktime_us_delta(ktime_get(), start);
 
 	/* After POR, we can run background GC thread */
 	if (start_gc_thread(sbi))
 	 goto fail;
+	if (test_opt(sbi, DISCARD) && start_discard_thread(sbi))
+	 goto fail;
+
+	sbi->mount_time[MOUNT_TOTAL] = ktime_us_delta(ktime_get(), mount_start);
 
 #ifdef CONFIG_F2FS_STAT_FS
 	if (f2fs_proc_root) {
@@ -458,8 +554,10 @@ static int f2fs_fill_super(struct super_block *sb, void *data, int silent)
 	 goto fail;
 	}
 #endif
+	register_shrinker(&sbi->extent_shrinker);
 	return 0;
 fail:
+	stop_discard_thread(sbi);
 	stop_gc_thread(sbi);
 free_root_inode:
 	make_bad_inode(root);
@@ -523,6 +621,10 @@ static int __init init_f2fs_fs(void)
 	 goto fail;
 	if (create_checkpoint_caches())
 	 goto fail;
+	if (create_segment_manager_caches())
+	 goto fail;
+	if (create_extent_cache())
+	 goto fail;
 	if (register_filesystem(&f2fs_fs_type))
 	 return -EBUSY;
 
@@ -536,6 +638,8 @@ static void __exit exit_f2fs_fs(void)
 {
 	remove_proc_entry("fs/f2fs", NULL);
 	unregister_filesystem(&f2fs_fs_type);
+	destroy_extent_cache();
+	destroy_segment_manager_caches();
 	destroy_checkpoint_caches();
 	destroy_gc_caches();
 	destroy_node_manager_caches();
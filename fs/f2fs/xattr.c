@@ -118,6 +118,69 @@ const struct xattr_handler f2fs_xattr_trusted_handler = {
 	.set = f2fs_xattr_generic_set,
 };
 
+static const char *f2fs_temp_names[] = {
+	[F2FS_TEMP_AUTO]	= "auto",
+	[F2FS_TEMP_HOT]	 = "hot",
+	[F2FS_TEMP_WARM]	= "warm",
+	[F2FS_TEMP_COLD]	= "cold",
+};
+
+/**
+ * The temperature hint is kept in i_advise rather than in the xattr area,
+ * so it is neither stored as an entry nor listed.
+ */
+static int f2fs_xattr_temp_get(struct dentry *dentry, const char *name,
+	 void *buffer, size_t size, int type)
+{
+	struct inode *inode = dentry->d_inode;
+	const char *temp;
+	size_t len;
+
+	if (!capable(CAP_SYS_ADMIN))
+	 return -EPERM;
+	if (strcmp(name, "") != 0)
+	 return -EINVAL;
+
+	temp = f2fs_temp_names[get_file_temp(F2FS_I(inode))];
+	len = strlen(temp);
+	if (buffer) {
+	 if (len > size)
+	 return -ERANGE;
+	 memcpy(buffer, temp, len);
+	}
+	return len;
+}
+
+static int f2fs_xattr_temp_set(struct dentry *dentry, const char *name,
+	 const void *value, size_t size, int flags, int type)
+{
+	struct inode *inode = dentry->d_inode;
+	int i;
+
+	if (!capable(CAP_SYS_ADMIN))
+	 return -EPERM;
+	if (strcmp(name, "") != 0)
+	 return -EINVAL;
+
+	/* removing the hint gives the file back to the classifier */
+	if (!value)
+	 return f2fs_set_file_temp(inode, F2FS_TEMP_AUTO);
+
+	for (i = 0; i < ARRAY_SIZE(f2fs_temp_names); i++) {
+	 if (size == strlen(f2fs_temp_names[i]) &&
+	 !memcmp(value, f2fs_temp_names[i], size))
+	 return f2fs_set_file_temp(inode, i);
+	}
+	return -EINVAL;
+}
+
+const struct xattr_handler f2fs_xattr_temp_handler = {
+	.prefix = F2FS_XATTR_TEMP_NAME,
+	.flags	= F2FS_XATTR_INDEX_TRUSTED,
+	.get = f2fs_xattr_temp_get,
+	.set = f2fs_xattr_temp_set,
+};
+
 static const struct xattr_handler *f2fs_xattr_handler_map[] = {
 	[F2FS_XATTR_INDEX_USER] = &f2fs_xattr_user_handler,
 #ifdef CONFIG_F2FS_FS_POSIX_ACL
@@ -133,6 +196,8 @@ const struct xattr_handler *f2fs_xattr_handlers[] = {
 	&f2fs_xattr_acl_access_handler,
 	&f2fs_xattr_acl_default_handler,
 #endif
+	/* should precede the trusted handler matching the same prefix */
+	&f2fs_xattr_temp_handler,
 	&f2fs_xattr_trusted_handler,
 	NULL,
 };
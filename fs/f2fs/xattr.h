@@ -34,6 +34,9 @@
 #define F2FS_XATTR_INDEX_LUSTRE 5
 #define F2FS_XATTR_INDEX_SECURITY 6
 
+/* Name of the xattr handling the temperature hint of a file */
+#define F2FS_XATTR_TEMP_NAME "trusted.f2fs.temperature"
+
 struct f2fs_xattr_header {
 	__le32 h_magic; /* magic number for identification */
 	__le32 h_refcount; /* reference count */
@@ -107,6 +110,7 @@ struct f2fs_xattr_entry {
 #ifdef CONFIG_F2FS_FS_XATTR
 extern const struct xattr_handler f2fs_xattr_user_handler;
 extern const struct xattr_handler f2fs_xattr_trusted_handler;
+extern const struct xattr_handler f2fs_xattr_temp_handler;
 extern const struct xattr_handler f2fs_xattr_acl_access_handler;
 extern const struct xattr_handler f2fs_xattr_acl_default_handler;
 
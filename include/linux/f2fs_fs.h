@@ -128,6 +128,22 @@ struct f2fs_orphan_block {
 	__le32 check_sum;	/* CRC32 for orphan inode block */
 } __packed;
 
+/*
+ * For segment map summary
+ * At umount, a header block followed by the bitmaps of free and dirty
+ * segments in Main area is written in front of data summaries in CP.
+ */
+#define F2FS_SEGMAP_BITS_PER_BLOCK	(F2FS_BLKSIZE * 8)
+
+struct f2fs_segmap_summary {
+	__le32 segment_count;	/* Number of segments in the bitmaps */
+	__le32 free_segment_count;	/* Number of free segments */
+	__le32 dirty_segment_count;	/* Number of dirty segments */
+	__le32 reserved;
+	__le64 min_mtime;	/* Min. modified time of sections */
+	__le64 max_mtime;	/* Max. modified time of sections */
+} __packed;
+
 /*
  * For NODE structure
  */
@@ -144,7 +160,8 @@ struct f2fs_extent {
 
 struct f2fs_inode {
 	__le16 i_mode;	 /* File mode */
-	__le16 i_reserved;	 /* Reserved */
+	__u8 i_advise;	 /* file hints */
+	__u8 i_reserved;	 /* Reserved */
 	__le32 i_uid;	 /* User ID */
 	__le32 i_gid;	 /* Group ID */
 	__le32 i_links;	 /* Links count */